@@ -0,0 +1,261 @@
+/*
+ * bench.c
+ *
+ * Cycle counts of the system calls and context switches. Each primitive is
+ * run many times and timed with TIMER1, free-running at the CPU clock, so a
+ * timer count is a CPU cycle. Results are printed as min/mean/max over UART0,
+ * which simavr prints on the console (see the Makefile in this directory).
+ *
+ * Interrupts stay enabled, so a max may include a TIMER3 interrupt; min and
+ * mean are what to track for regressions.
+ */
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include "../os.h"
+
+#define ITERATIONS      1000
+#define CREATE_ITERATIONS 100
+#define TICK_SAMPLES    20
+#define TICK_THRESHOLD  100   // a gap in the spin loop longer than this is an interrupt
+
+typedef struct {
+	unsigned int min;
+	unsigned int max;
+	unsigned long sum;
+	unsigned int n;
+} STATS;
+
+static unsigned int overhead;   // cost of the two TCNT1 reads themselves
+
+static volatile CHAN ping;
+static volatile CHAN pong;
+static volatile CHAN done;
+static volatile CHAN quiet;
+static volatile CHAN ring;
+static volatile SEM sem_quiet;
+static volatile SEM sem_ping;
+static volatile SEM sem_pong;
+static volatile EVENT event_quiet;
+static volatile unsigned int switch_start;
+static STATS stats;
+
+/*============
+* UART0 output, polled
+*============
+*/
+static void uart_init()
+{
+	UBRR0 = 51;                 // 38400 baud at 16 MHz with U2X
+	UCSR0A = (1<<U2X0);
+	UCSR0B = (1<<TXEN0);
+	UCSR0C = (1<<UCSZ01) | (1<<UCSZ00);
+}
+
+static void uart_putc(char c)
+{
+	while (!(UCSR0A & (1<<UDRE0)));
+	UDR0 = c;
+}
+
+static void uart_puts(const char *s)
+{
+	while (*s) uart_putc(*s++);
+}
+
+static void uart_putu(unsigned long v)
+{
+	char buf[11];
+	int i = 0;
+	do {
+		buf[i++] = '0' + (v % 10);
+		v /= 10;
+	} while (v > 0);
+	while (i > 0) uart_putc(buf[--i]);
+}
+
+/*============
+* Statistics
+*============
+*/
+static void stats_reset(STATS *st)
+{
+	st->min = 0xFFFF;
+	st->max = 0;
+	st->sum = 0;
+	st->n = 0;
+}
+
+static void stats_add(STATS *st, unsigned int cycles)
+{
+	cycles = (cycles > overhead) ? cycles - overhead : 0;
+	if (cycles < st->min) st->min = cycles;
+	if (cycles > st->max) st->max = cycles;
+	st->sum += cycles;
+	st->n++;
+}
+
+static void stats_print(const char *name, STATS *st)
+{
+	uart_puts(name);
+	uart_puts(": min ");
+	uart_putu(st->min);
+	uart_puts(" mean ");
+	uart_putu(st->n ? st->sum / st->n : 0);
+	uart_puts(" max ");
+	uart_putu(st->max);
+	uart_puts(" cycles (n=");
+	uart_putu(st->n);
+	uart_puts(")\r\n");
+}
+
+/*============
+* Helper tasks
+*============
+*/
+
+// Echoes every value from "ping" back on "pong"
+void Task_Echo()
+{
+	for(;;) {
+		Send(pong, Recv(ping));
+	}
+}
+
+// Signals "sem_pong" for every signal of "sem_ping"
+void Task_Sem_Echo()
+{
+	for(;;) {
+		Sem_Wait(sem_ping);
+		Sem_Signal(sem_pong);
+	}
+}
+
+// Two RR tasks switching back and forth with Task_Next()
+void Task_Switch_A()
+{
+	int i;
+	// one more than B records, so that B never times our termination
+	for (i = 0; i <= ITERATIONS; i++) {
+		switch_start = TCNT1;
+		Task_Next();
+	}
+}
+
+void Task_Switch_B()
+{
+	int i;
+	Task_Next();
+	for (i = 0; i < ITERATIONS; i++) {
+		stats_add(&stats, TCNT1 - switch_start);
+		Task_Next();
+	}
+	Send(done, 0);
+}
+
+// Spins alone, every long gap between two reads of TCNT1 is an interrupt
+void Task_Spin()
+{
+	unsigned int last = TCNT1;
+	while (stats.n < TICK_SAMPLES) {
+		unsigned int now = TCNT1;
+		if (now - last > TICK_THRESHOLD) stats_add(&stats, now - last);
+		last = now;
+	}
+	Send(done, 0);
+}
+
+void Task_Nothing()
+{
+}
+
+/*============
+* Benchmarks, run by a_main() as a System task
+*============
+*/
+static void bench_calibrate()
+{
+	unsigned int t0, t1;
+	overhead = 0;
+	t0 = TCNT1;
+	t1 = TCNT1;
+	overhead = t1 - t0;
+}
+
+#define BENCH(name, n, op) do {                 \
+	int i;                                      \
+	stats_reset(&stats);                        \
+	for (i = 0; i < (n); i++) {                 \
+		unsigned int t0 = TCNT1;                \
+		op;                                     \
+		stats_add(&stats, TCNT1 - t0);          \
+	}                                           \
+	stats_print(name, &stats);                  \
+} while (0)
+
+void a_main()
+{
+	int i;
+
+	uart_init();
+	// TIMER1 free-running at 1/1
+	TCCR1A = 0;
+	TCCR1B = (1<<CS10);
+	bench_calibrate();
+
+	uart_puts("\r\nP2_WRR system call benchmark\r\n");
+
+	done = Chan_Init();
+	quiet = Chan_Init();
+	ping = Chan_Init();
+	pong = Chan_Init();
+	ring = Chan_Init_Buffered(16);
+	sem_quiet = Sem_Init(0);
+	sem_ping = Sem_Init(0);
+	sem_pong = Sem_Init(0);
+	event_quiet = Event_Init();
+
+	BENCH("Task_Next (nothing else ready)", ITERATIONS, Task_Next());
+	BENCH("Write (no receivers)", ITERATIONS, Write(quiet, i));
+	// Plain signalling, to compare with Write
+	BENCH("Sem_Signal (no waiters)", ITERATIONS, Sem_Signal(sem_quiet));
+	BENCH("Event_Set (no waiters)", ITERATIONS, Event_Set(event_quiet, 1));
+	BENCH("Now", ITERATIONS, Now());
+	BENCH("Chan_Init", MAXCHAN - 5, Chan_Init());
+	// Both calls are self-served, the value just goes through the buffer
+	BENCH("Send+Recv buffered (no switch)", ITERATIONS, { Send(ring, i); Recv(ring); });
+
+	// Creates an RR task that terminates when we block on done
+	stats_reset(&stats);
+	for (i = 0; i < CREATE_ITERATIONS; i++) {
+		unsigned int t0 = TCNT1;
+		Task_Create_RR(Task_Nothing, 0);
+		stats_add(&stats, TCNT1 - t0);
+		Task_Sleep(1);
+	}
+	stats_print("Task_Create_RR", &stats);
+
+	// A Send wakes the echo task, our Recv blocks until it answers
+	Task_Create_System(Task_Echo, 0);
+	BENCH("Send+Recv round trip (2 switches)", ITERATIONS, { Send(ping, i); Recv(pong); });
+
+	// The same with semaphores
+	Task_Create_System(Task_Sem_Echo, 0);
+	BENCH("Sem_Signal+Wait round trip (2 switches)", ITERATIONS, { Sem_Signal(sem_ping); Sem_Wait(sem_pong); });
+
+	stats_reset(&stats);
+	Task_Create_RR(Task_Switch_A, 0);
+	Task_Create_RR(Task_Switch_B, 0);
+	Recv(done);
+	stats_print("Task_Next (RR to RR switch)", &stats);
+
+	stats_reset(&stats);
+	Task_Create_RR(Task_Spin, 0);
+	Recv(done);
+	stats_print("TIMER3 tick (no switch)", &stats);
+
+	uart_puts("done\r\n");
+	// simavr quits when the CPU sleeps with interrupts off
+	Disable_Interrupt();
+	sleep_enable();
+	sleep_cpu();
+}
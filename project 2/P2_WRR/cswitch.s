@@ -9,6 +9,10 @@ SPH   = 0x3E
 SPL   = 0x3D
 EIND  = 0x3C
 
+/* frame types, kept on top of a suspended task's stack (see os.c) */
+FRAME_FULL      = 0
+FRAME_VOLUNTARY = 1
+
 /*
   * MACROS
   */
@@ -97,11 +101,60 @@ EIND  = 0x3C
 	pop	r1
 	pop	r0
 .endm
+;
+; Push the call-saved registers only (r2-r17, r28, r29). This is all that
+; must survive a function call in the avr-gcc ABI, so it is enough for the
+; kernel's own context and for a task that calls into the kernel voluntarily.
+;
+.macro	VSAVECTX
+	push	r2
+	push	r3
+	push	r4
+	push	r5
+	push	r6
+	push	r7
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	push	r16
+	push	r17
+	push	r28
+	push	r29
+.endm
+;
+; Pop the call-saved registers, in reverse order of VSAVECTX
+;
+.macro	VRESTORECTX
+	pop	r29
+	pop	r28
+	pop	r17
+	pop	r16
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	r7
+	pop	r6
+	pop	r5
+	pop	r4
+	pop	r3
+	pop	r2
+.endm
 
         .section .text
         .global CSwitch
         .global Exit_Kernel
         .global Enter_Kernel
+        .global Enter_Kernel_Voluntary
         .extern  KernelSp
         .extern  CurrentSp
 /*
@@ -116,8 +169,19 @@ EIND  = 0x3C
   * Note: AVR devices use LITTLE endian format, i.e., a 16-bit value starts
   * with the lower-order byte first, then the higher-order byte.
   *
-  * void CSwitch();
-  * void Exit_Kernel();
+  * A suspended task has one of two frames on its stack, identified by the
+  * frame type byte on top: a FRAME_FULL context saved by SAVECTX (preemption
+  * by an interrupt, and every new task), or a FRAME_VOLUNTARY context saved by
+  * VSAVECTX (a system call). The kernel itself is always suspended in a call
+  * to Exit_Kernel(), so only its call-saved registers are kept.
+  *
+  * Exit_Kernel() "returns" when Cp enters the kernel again. Neither the
+  * context save nor the switch touches r25:r24, so the kernel gets the
+  * argument Cp passed to Enter_Kernel(), i.e. its system call, as the
+  * return value.
+  *
+  * struct KernelCall *CSwitch();
+  * struct KernelCall *Exit_Kernel();
   */
 CSwitch:
 Exit_Kernel:
@@ -125,7 +189,7 @@ Exit_Kernel:
           * This is the "top" half of CSwitch(), generally called by the kernel.
           * Assume I = 0, i.e., all interrupts are disabled.
           */
-        SAVECTX
+        VSAVECTX
         /*
           * Now, we have saved the kernel's context.
           * Save the current H/W stack pointer into KernelSp.
@@ -146,22 +210,31 @@ Exit_Kernel:
           * We are now executing in Cp's stack.
           * Note: at the bottom of the Cp's context is its return address.
           */
+        pop  r30
+        cpi  r30, FRAME_VOLUNTARY
+        breq 1f
         RESTORECTX
         reti         /* re-enable all global interrupts */
+1:
+        VRESTORECTX
+        clr  r1      /* __zero_reg__, the caller expects it to be 0 */
+        reti         /* re-enable all global interrupts */
 /*
   * All system call eventually enters here!
   * There are two possibilities how we get here:
   *  1) Cp explicitly invokes one of the kernel API call stub, which indirectly
   *       invoke Enter_Kernel().
   *  2) a timer interrupt, which somehow "jumps" into here.
-  * Let us consider case (1) first. You have to figure out how to deal with
-  * timer interrupts yourself.
+  * Case (2) must use Enter_Kernel(), which saves the full context. A system
+  * call stub uses Enter_Kernel_Voluntary(), which only saves the registers the
+  * stub's caller expects to survive the call; that is about half the pushes
+  * and pops, and a smaller frame on the task's stack.
   *
   * Assumption: All interrupts are disabled upon entering here, and
   *     we are still executing on Cp's stack. The return address of
   *     the caller of Enter_Kernel() is on the top of the stack.
   *
-  * void Enter_Kernel();
+  * void Enter_Kernel(struct KernelCall *call);
   */
 Enter_Kernel:
         /*
@@ -169,6 +242,9 @@ Enter_Kernel:
           * Cp's context.
           */
         SAVECTX
+        ldi  r16, FRAME_FULL
+        push r16
+ENTER_KERNEL_SWITCH:
         /*
           * Now, we have saved the Cp's context.
           * Save the current H/W stack pointer into CurrentSp.
@@ -188,11 +264,24 @@ Enter_Kernel:
         /*
           * We are now executing in kernel's stack.
           */
-       RESTORECTX
+       VRESTORECTX   /* r25:r24 is still the "call" argument of Cp */
+       clr  r1       /* __zero_reg__, Cp may have been interrupted while using it */
         /*
           * We are ready to return to the caller of CSwitch() (or Exit_Kernel()).
-          * Note: We should NOT re-enable interrupts while kernel is running.
+          * Note: We should NOT re-enable interrupts here, the kernel does
+          *         that itself once it has set InKernel (see os.c).
           *         Therefore, we use "ret", and not "reti".
           */
        ret
+/*
+  * void Enter_Kernel_Voluntary(struct KernelCall *call);
+  *
+  * Same as Enter_Kernel(), for a task calling into the kernel from a system
+  * call stub. Interrupts must be disabled by the caller.
+  */
+Enter_Kernel_Voluntary:
+        VSAVECTX
+        ldi  r16, FRAME_VOLUNTARY
+        push r16
+        rjmp ENTER_KERNEL_SWITCH
 /* end of CSwitch() */
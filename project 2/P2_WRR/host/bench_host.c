@@ -0,0 +1,389 @@
+/*
+ * bench_host.c
+ *
+ * Throughput and latency of the kernel's scheduling and channel operations,
+ * built with the Linux host port (see Makefile). The numbers measure the
+ * kernel logic on a PC, including the cost of swapcontext(); they are for
+ * comparing kernel changes at scale, not for predicting AVR timings.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "os.h"
+#include "port.h"
+
+#define ROUND_TRIPS     200000
+#define WRITES          1000000
+#define SWITCH_TASKS    (MAXPROCESS - 8)
+#define SWITCHES        1000
+#define RECEIVERS       8
+#define MULTICASTS      100000
+#define SCALE_WRITES    10000
+#define SCALE_MAX       64
+#define MESSAGES        200000
+#define RING            16
+#define IRQS            2000
+#define IRQ_PERIOD_NS   200000
+#define CREATES         200000
+#define CREATE_BATCH    (MAXPROCESS / 2)
+
+static CHAN ping, pong, done, quiet, multi, stream, irq;
+static MUTEX mutex;
+static SEM sem_quiet, sem_ping, sem_pong;
+static EVENT event;
+static PID main_pid, echo_pid;
+static volatile int running;
+static volatile long long irq_at;    // when the external interrupt fires, in ns
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double ns, long ops)
+{
+	printf("%-40s %10ld ops %10.0f ops/s %8.1f ns/op\n", name, ops, ops / (ns / 1e9), ns / ops);
+	fflush(stdout);
+}
+
+// Echoes every value from "ping" back on "pong"
+void Task_Echo()
+{
+	for(;;) {
+		Send(pong, Recv(ping));
+	}
+}
+
+// Signals "sem_pong" for every signal on "sem_ping"
+void Task_Sem_Echo()
+{
+	for(;;) {
+		Sem_Wait(sem_ping);
+		Sem_Signal(sem_pong);
+	}
+}
+
+// Sets flag 2 for every flag 1 it clears
+void Task_Event_Echo()
+{
+	for(;;) {
+		Event_Wait(event, 1, EVENT_CLEAR);
+		Event_Set(event, 2);
+	}
+}
+
+// Notifies a_main back for every notification
+void Task_Notify_Echo()
+{
+	for(;;) {
+		Task_Notify_Wait(0, NULL, WAIT_FOREVER);
+		Task_Notify(main_pid, 0, NOTIFY_INCREMENT);
+	}
+}
+
+// One of many RR tasks taking turns
+void Task_Switcher()
+{
+	int i;
+	for (i = 0; i < SWITCHES; i++) {
+		Task_Next();
+	}
+	if (--running == 0) Send(done, 0);
+}
+
+// A short-lived RR task, the last one of a batch wakes a_main
+void Task_Worker()
+{
+	if (--running == 0) Send(done, 0);
+}
+
+// An RR producer and consumer streaming MESSAGES values over "stream"
+void Task_Producer()
+{
+	int i;
+	for (i = 0; i < MESSAGES; i++) {
+		Send(stream, i);
+	}
+}
+
+void Task_Consumer()
+{
+	int i;
+	for (i = 0; i < MESSAGES; i++) {
+		if (Recv(stream) != i) {
+			printf("stream out of order at %d\n", i);
+			exit(1);
+		}
+	}
+	Send(done, 0);
+}
+
+static void bench_stream(const char *name, CHAN ch)
+{
+	double t0;
+	stream = ch;
+	Task_Create_RR(Task_Consumer, 0);
+	Task_Create_RR(Task_Producer, 0);
+	t0 = now_ns();
+	Recv(done);
+	report(name, now_ns() - t0, MESSAGES);
+}
+
+void Task_Receiver()
+{
+	for(;;) {
+		Recv(multi);
+	}
+}
+
+// A System receiver of the CHAN in its argument
+void Task_Scale_Receiver()
+{
+	for(;;) {
+		Recv(Task_GetArg());
+	}
+}
+
+static volatile double write_ns;
+
+// A RR sender. System receivers preempt it, so the kernel wakes them; RR
+// receivers do not, and it only times the Write() that wakes them.
+void Task_Multicaster()
+{
+	double t0;
+	int i;
+
+	write_ns = 0;
+	for (i = 0; i < SCALE_WRITES; i++) {
+		t0 = now_ns();
+		Write(Task_GetArg(), i);
+		write_ns += now_ns() - t0;
+		// the RR receivers get back into Recv()
+		Task_Next();
+	}
+	Send(done, 0);
+}
+
+// Write() to "n" waiting System or RR receivers, who all run once per Write()
+static void bench_multicast(int n, BOOL system)
+{
+	char name[48];
+	double t0, ns;
+	CHAN ch = Chan_Init();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (system) {
+			Task_Create_System(Task_Scale_Receiver, ch);
+		} else {
+			Task_Create_RR(Task_Scale_Receiver, ch);
+		}
+	}
+	// let the System ones get into Recv()
+	Task_Next();
+	Task_Create_RR(Task_Multicaster, ch);
+	t0 = now_ns();
+	Recv(done);
+	ns = now_ns() - t0;
+	if (system) {
+		snprintf(name, sizeof(name), "RR Write to %d System receivers", n);
+	} else {
+		snprintf(name, sizeof(name), "  the Write() alone, to %d RR receivers", n);
+		ns = write_ns;
+	}
+	printf("%-40s %10d ops %8.1f ns/op %8.1f ns/receiver\n", name, SCALE_WRITES, ns / SCALE_WRITES,
+		ns / SCALE_WRITES / n);
+	fflush(stdout);
+}
+
+// The "device" interrupt, it wakes up Task_Irq_Server
+static void Irq_Handler()
+{
+	Write_FromISR(irq, 0);
+	ISR_Exit();
+}
+
+static void Irq_Arm()
+{
+	irq_at = (long long)now_ns() + IRQ_PERIOD_NS;
+	Host_Ext_Interrupt_At(irq_at);
+}
+
+// A System task serving the interrupt, it measures how long after the interrupt it runs
+void Task_Irq_Server()
+{
+	double t, sum = 0, min = 1e18, max = 0;
+	int i;
+
+	Irq_Arm();
+	for (i = 0; i < IRQS; i++) {
+		Recv(irq);
+		t = now_ns() - irq_at;
+		sum += t;
+		if (t < min) min = t;
+		if (t > max) max = t;
+		Irq_Arm();
+	}
+	Host_Ext_Interrupt_At(0);
+	running = 0;
+	printf("%-40s min %.1f us, avg %.1f us, max %.1f us\n", "ISR -> System task, RR task busy",
+		min / 1e3, sum / IRQS / 1e3, max / 1e3);
+	fflush(stdout);
+}
+
+// Keeps the CPU busy, so that the server has to preempt it
+void Task_Spinner()
+{
+	while (running) {
+	}
+	Send(done, 0);
+}
+
+void a_main()
+{
+	double t0, t, min = 1e18, max = 0;
+	long i;
+
+	done = Chan_Init();
+	quiet = Chan_Init();
+	ping = Chan_Init();
+	pong = Chan_Init();
+	multi = Chan_Init();
+
+	printf("P2_WRR host port benchmark, MAXPROCESS=%d\n", MAXPROCESS);
+
+	t0 = now_ns();
+	for (i = 0; i < WRITES; i++) {
+		Write(quiet, i);
+	}
+	report("Write (no receivers)", now_ns() - t0, WRITES);
+
+	sem_quiet = Sem_Init(0);
+	t0 = now_ns();
+	for (i = 0; i < WRITES; i++) {
+		Sem_Signal(sem_quiet);
+	}
+	report("Sem_Signal (no waiters)", now_ns() - t0, WRITES);
+
+	event = Event_Init();
+	t0 = now_ns();
+	for (i = 0; i < WRITES; i++) {
+		Event_Set(event, 4);
+	}
+	report("Event_Set (no waiters)", now_ns() - t0, WRITES);
+
+	main_pid = Task_GetPid();
+	echo_pid = Task_Create_System(Task_Notify_Echo, 0);
+	t0 = now_ns();
+	for (i = 0; i < WRITES; i++) {
+		// it has not run yet, so it is not waiting
+		Task_Notify(echo_pid, 1, NOTIFY_SET_BITS);
+	}
+	report("Task_Notify (not waiting)", now_ns() - t0, WRITES);
+
+	mutex = Mutex_Init();
+	t0 = now_ns();
+	for (i = 0; i < WRITES; i++) {
+		Mutex_Lock(mutex);
+		Mutex_Unlock(mutex);
+	}
+	report("Mutex_Lock+Unlock (free)", now_ns() - t0, WRITES);
+
+	// Batches of workers that only run once a_main blocks, so every one of them
+	// is created, run and terminated
+	t = 0;
+	t0 = now_ns();
+	for (i = 0; i < CREATES; i += CREATE_BATCH) {
+		double s = now_ns();
+		int j;
+		running = CREATE_BATCH;
+		for (j = 0; j < CREATE_BATCH; j++) {
+			if (Task_Create_RR(Task_Worker, 0) == 0) {
+				printf("Task_Create_RR failed\n");
+				exit(1);
+			}
+		}
+		t += now_ns() - s;
+		Recv(done);
+	}
+	report("Task_Create_RR", t, i);
+	report("  created, run and terminated", now_ns() - t0, i);
+
+	Task_Create_System(Task_Echo, 0);
+	t0 = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		double s = now_ns();
+		Send(ping, i);
+		Recv(pong);
+		t = now_ns() - s;
+		if (t < min) min = t;
+		if (t > max) max = t;
+	}
+	report("Send+Recv round trip (2 switches)", now_ns() - t0, ROUND_TRIPS);
+	printf("%-40s min %.0f ns, max %.0f ns\n", "  round trip latency", min, max);
+
+	sem_ping = Sem_Init(0);
+	sem_pong = Sem_Init(0);
+	Task_Create_System(Task_Sem_Echo, 0);
+	t0 = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		Sem_Signal(sem_ping);
+		Sem_Wait(sem_pong);
+	}
+	report("Sem_Signal+Wait round trip (2 switches)", now_ns() - t0, ROUND_TRIPS);
+
+	Task_Create_System(Task_Event_Echo, 0);
+	t0 = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		Event_Set(event, 1);
+		Event_Wait(event, 2, EVENT_CLEAR);
+	}
+	report("Event_Set+Wait round trip (2 switches)", now_ns() - t0, ROUND_TRIPS);
+
+	t0 = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		Task_Notify(echo_pid, 1, NOTIFY_SET_BITS);
+		Task_Notify_Wait(~0U, NULL, WAIT_FOREVER);
+	}
+	report("Task_Notify+Wait round trip (2 switches)", now_ns() - t0, ROUND_TRIPS);
+
+	running = SWITCH_TASKS;
+	for (i = 0; i < SWITCH_TASKS; i++) {
+		Task_Create_RR(Task_Switcher, 0);
+	}
+	t0 = now_ns();
+	Recv(done);
+	report("Task_Next RR switches", now_ns() - t0, (long)SWITCH_TASKS * SWITCHES);
+
+	bench_stream("RR producer -> consumer, unbuffered", Chan_Init());
+	bench_stream("RR producer -> consumer, 16 buffered", Chan_Init_Buffered(RING));
+
+	for (i = 0; i < RECEIVERS; i++) {
+		Task_Create_System(Task_Receiver, 0);
+	}
+	t0 = now_ns();
+	for (i = 0; i < MULTICASTS; i++) {
+		// let every receiver get back into Recv()
+		Task_Next();
+		Write(multi, i);
+	}
+	report("Write to 8 receivers (+ Task_Next)", now_ns() - t0, MULTICASTS);
+
+	for (i = 1; i <= SCALE_MAX; i *= 4) {
+		bench_multicast(i, TRUE);
+		bench_multicast(i, FALSE);
+	}
+
+	// buffered, so that an interrupt before the server is back in Recv() is not lost
+	irq = Chan_Init_Buffered(1);
+	Host_Ext_Interrupt_Init(Irq_Handler);
+	running = 1;
+	Task_Create_RR(Task_Spinner, 0);
+	Task_Create_System(Task_Irq_Server, 0);
+	Recv(done);
+
+	exit(0);
+}
@@ -0,0 +1,309 @@
+/*
+ * port_host.c
+ *
+ * Linux host port of the RTOS, see port_host.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include "../port.h"
+
+#define NSEC_PER_COUNT   (1000000LL / TIMER_COUNTS_PER_MS)
+
+/**
+* A task's context lives at the top of its workspace, and its stack grows down
+* from there like on the AVR. The task's "stack pointer" points at this frame.
+*/
+typedef struct HostFrame
+{
+	ucontext_t ctx;
+	void (*code)(void);
+	void (*terminate)(void);
+} HOST_FRAME;
+
+// Shared with os.c, the frame of the task the kernel switches to
+extern volatile unsigned char *CurrentSp;
+
+static ucontext_t kernel_ctx;
+static void *kernel_call;          // the system call Cp is making
+
+static sigset_t irq_signals;       // SIGALRM and SIGUSR1, always masked together
+static ucontext_t frame_template;  // the context every new task starts from
+static timer_t timer;
+static long long window_start;     // in ns, CLOCK_MONOTONIC
+static unsigned int compare;
+static int window_pending;         // a window has ended and been counted, its signal not yet handled
+
+static timer_t ext_timer;
+static void (*ext_isr)(void);
+
+/*============
+* Interrupts
+*============
+*/
+
+// Runs before main(), so that interrupts can be masked right from the start
+__attribute__((constructor)) static void Host_Init()
+{
+	sigemptyset(&irq_signals);
+	sigaddset(&irq_signals, SIGALRM);
+	sigaddset(&irq_signals, SIGUSR1);
+	// getcontext() is a system call, so a new task copies this one instead
+	getcontext(&frame_template);
+	frame_template.uc_link = NULL;
+	frame_template.uc_sigmask = irq_signals;    // see Exit_Kernel()
+}
+
+void Host_Disable_Interrupt()
+{
+	sigprocmask(SIG_BLOCK, &irq_signals, NULL);
+}
+
+void Host_Enable_Interrupt()
+{
+	sigprocmask(SIG_UNBLOCK, &irq_signals, NULL);
+}
+
+IRQ_STATE Host_Save_Interrupt()
+{
+	sigset_t current;
+	sigprocmask(SIG_BLOCK, NULL, &current);
+	return !sigismember(&current, SIGALRM);
+}
+
+void Host_Restore_Interrupt(IRQ_STATE s)
+{
+	if (s) {
+		Host_Enable_Interrupt();
+	} else {
+		Host_Disable_Interrupt();
+	}
+}
+
+void Host_Abort(unsigned int error)
+{
+	fprintf(stderr, "OS_Abort(%u)\n", error);
+	exit(error & 0xFF ? error & 0xFF : 1);
+}
+
+/*============
+* Context switching
+*============
+*/
+
+/**
+* The kernel resumes the task whose frame is in CurrentSp. Like "reti", the
+* task always continues with interrupts enabled, but only the task enables
+* them, once it runs on its own stack: swapcontext() sets the new signal mask
+* before it switches stacks, and a timer signal delivered in between would
+* run the ISR on the kernel's stack with Cp already switched.
+* Returns the system call passed to Enter_Kernel(), like r25:r24 on the AVR.
+*/
+void *Exit_Kernel()
+{
+	HOST_FRAME *frame = (HOST_FRAME *)CurrentSp;
+	swapcontext(&kernel_ctx, &(frame->ctx));
+	return kernel_call;
+}
+
+void *CSwitch()
+{
+	return Exit_Kernel();
+}
+
+/**
+* Cp enters the kernel. CurrentSp is still Cp's frame, as the kernel set it
+* before switching to Cp. A ucontext holds all registers, so there is no
+* difference between a voluntary and a preemptive switch here.
+*/
+void Enter_Kernel(void *call)
+{
+	HOST_FRAME *frame = (HOST_FRAME *)CurrentSp;
+	kernel_call = call;
+	swapcontext(&(frame->ctx), &kernel_ctx);
+	// resumed by Exit_Kernel()
+	Host_Enable_Interrupt();
+}
+
+void Enter_Kernel_Voluntary(void *call)
+{
+	Enter_Kernel(call);
+}
+
+static void Host_Task_Start()
+{
+	HOST_FRAME *frame = (HOST_FRAME *)CurrentSp;
+	Host_Enable_Interrupt();
+	frame->code();
+	frame->terminate();
+}
+
+unsigned char *Port_Init_Frame(unsigned char *stack, unsigned int size, void (*f)(void), void (*terminate)(void))
+{
+	HOST_FRAME *frame = (HOST_FRAME *)((uintptr_t)(stack + size - sizeof(HOST_FRAME)) & ~(uintptr_t)15);
+
+	frame->ctx = frame_template;
+	frame->ctx.uc_stack.ss_sp = stack;
+	frame->ctx.uc_stack.ss_size = (unsigned char *)frame - stack;
+	frame->code = f;
+	frame->terminate = terminate;
+	makecontext(&(frame->ctx), Host_Task_Start, 0);
+	return (unsigned char *)frame;
+}
+
+/*============
+* TIMER3 emulation, in CTC mode
+*============
+*/
+static long long Host_Clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Arms the POSIX timer for the end of the current compare window
+static void Host_Timer_Arm()
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	long long at = window_start + (compare + 1LL) * NSEC_PER_COUNT;
+	its.it_value.tv_sec = at / 1000000000LL;
+	its.it_value.tv_nsec = at % 1000000000LL;
+	timer_settime(timer, TIMER_ABSTIME, &its, NULL);
+}
+
+static void Host_Timer_Signal(int sig)
+{
+	(void)sig;
+	// the counter restarts from 0 at the end of the window, unless
+	// Host_Timer_Set_Compare() has already restarted it
+	if (window_pending) {
+		window_pending = 0;
+	} else {
+		window_start += (compare + 1LL) * NSEC_PER_COUNT;
+	}
+	Host_Timer_Arm();
+	Host_Timer_ISR();
+}
+
+unsigned int Host_Timer_Count()
+{
+	long long counts = (Host_Clock() - window_start) / NSEC_PER_COUNT;
+	// the window has ended, but its interrupt is still pending
+	if (counts > compare) counts -= compare + 1;
+	return counts > 0xFFFF ? 0xFFFF : (unsigned int)counts;
+}
+
+unsigned int Host_Timer_Compare()
+{
+	return compare;
+}
+
+void Host_Timer_Set_Compare(unsigned int c)
+{
+	// the kernel reprograms the timer on every exit, mostly with the same value
+	if (c == compare) return;
+	// Like TIMER3, a window that has already ended keeps its length: the counter
+	// restarts and its interrupt stays pending, the new value is for the next window
+	if (!window_pending && (Host_Clock() - window_start) / NSEC_PER_COUNT > compare) {
+		window_start += (compare + 1LL) * NSEC_PER_COUNT;
+		window_pending = 1;
+	}
+	compare = c;
+	Host_Timer_Arm();
+	// the old expiry may be gone with the old setting, signals of a kind do not queue
+	if (window_pending) raise(SIGALRM);
+}
+
+int Host_Timer_Window_Ended()
+{
+	return window_pending || (Host_Clock() - window_start) / NSEC_PER_COUNT > compare;
+}
+
+void Port_Timer_Init(unsigned int c)
+{
+	struct sigaction sa;
+	struct sigevent sev;
+
+	sa.sa_handler = Host_Timer_Signal;
+	sa.sa_mask = irq_signals;     // ISRs do not nest
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_value.sival_ptr = NULL;
+	if (timer_create(CLOCK_MONOTONIC, &sev, &timer) != 0) {
+		perror("timer_create");
+		exit(1);
+	}
+
+	window_start = Host_Clock();
+	compare = c;
+	Host_Timer_Arm();
+}
+
+// Nothing to start, the clock is CLOCK_MONOTONIC
+void Port_Trace_Init()
+{
+}
+
+unsigned int Host_Trace_Clock()
+{
+	return (unsigned int)(Host_Clock() / (1000 / TRACE_COUNTS_PER_US));
+}
+
+/*============
+* An external interrupt, e.g. a UART or the ADC, emulated with a POSIX timer
+* delivering SIGUSR1
+*============
+*/
+static void Host_Ext_Signal(int sig)
+{
+	(void)sig;
+	ext_isr();
+}
+
+void Host_Ext_Interrupt_Init(void (*isr)(void))
+{
+	struct sigaction sa;
+	struct sigevent sev;
+
+	ext_isr = isr;
+	sa.sa_handler = Host_Ext_Signal;
+	sa.sa_mask = irq_signals;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGUSR1;
+	sev.sigev_value.sival_ptr = NULL;
+	if (timer_create(CLOCK_MONOTONIC, &sev, &ext_timer) != 0) {
+		perror("timer_create");
+		exit(1);
+	}
+}
+
+void Host_Ext_Interrupt_At(long long ns)
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	its.it_value.tv_sec = ns / 1000000000LL;
+	its.it_value.tv_nsec = ns % 1000000000LL;
+	timer_settime(ext_timer, TIMER_ABSTIME, &its, NULL);
+}
+
+void Host_Cpu_Idle()
+{
+	sigset_t none;
+	sigemptyset(&none);
+	sigsuspend(&none);
+}
+
+// No debug pins on the host
+void Port_Debug_Init()
+{
+}
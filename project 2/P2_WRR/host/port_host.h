@@ -0,0 +1,65 @@
+/*
+ * port_host.h
+ *
+ * Linux host port of the RTOS, included by port.h when HOST_PORT is defined.
+ *
+ * The kernel and the tasks run in a single Linux process. Each task has a
+ * ucontext on its workspace, and the kernel switches between them with
+ * swapcontext(). TIMER3 is emulated with a POSIX timer delivering SIGALRM,
+ * an external interrupt with one delivering SIGUSR1, and "interrupts
+ * disabled" means both signals are blocked. The virtual TIMER3
+ * counts at the same rate as the AVR one, so tick and tickless behaviour are
+ * the same as on the board.
+ */
+#ifndef _PORT_HOST_H_
+#define _PORT_HOST_H_
+
+// Argument given to a_main()
+#define A_MAIN_ARG 0
+
+typedef int IRQ_STATE;   // TRUE if interrupts are enabled
+IRQ_STATE Host_Save_Interrupt(void);
+void Host_Restore_Interrupt(IRQ_STATE s);
+#define Save_Interrupt()        Host_Save_Interrupt()
+#define Restore_Interrupt(s)    Host_Restore_Interrupt(s)
+#define Interrupts_Enabled(s)   (s)
+
+void Host_Abort(unsigned int error);
+#define Debug_Kernel_Entry()
+#define Debug_Abort(error)      Host_Abort(error)
+
+#if TICKLESS
+#define TIMER_COUNTS_PER_MS    250
+#else
+#define TIMER_COUNTS_PER_MS    2000
+#endif
+
+#define ISR(vector)             void vector(void)
+void Host_Timer_ISR(void);
+#define TIMER_ISR               Host_Timer_ISR
+unsigned int Host_Timer_Count(void);
+unsigned int Host_Timer_Compare(void);
+void Host_Timer_Set_Compare(unsigned int compare);
+int Host_Timer_Window_Ended(void);
+#define Timer_Count()           Host_Timer_Count()
+#define Timer_Compare()         Host_Timer_Compare()
+#define Timer_Set_Compare(c)    Host_Timer_Set_Compare(c)
+#define Timer_Window_Ended()    Host_Timer_Window_Ended()
+
+// The clock of IRQ_TRACE, in the same units as on the AVR
+unsigned int Host_Trace_Clock(void);
+#define Trace_Clock()           Host_Trace_Clock()
+#define TRACE_COUNTS_PER_US     2
+
+// An external interrupt running "isr" at "ns" on CLOCK_MONOTONIC, for measuring
+// ISR to task latency; "isr" is an ISR like any other, see ISR_Exit()
+void Host_Ext_Interrupt_Init(void (*isr)(void));
+void Host_Ext_Interrupt_At(long long ns);
+
+// The ucontext and the signal handler frames live on a task's stack
+#define PORT_MIN_STACK          16384
+
+void Host_Cpu_Idle(void);
+#define Cpu_Idle()              Host_Cpu_Idle()
+
+#endif /* _PORT_HOST_H_ */
@@ -0,0 +1,65 @@
+/*
+ * test_timer_window.c
+ *
+ * A compare window that ends while interrupts are disabled must still be
+ * counted with its own length, even if the timer is reprogrammed before its
+ * interrupt runs. An RR task disables interrupts, waits for the window to end
+ * and then creates another RR task. The creation is self-served and leaves
+ * through Timer_Program(), which now wants a window of one quantum instead of
+ * the longest one. Built with TICKLESS set (see Makefile).
+ * The expected behaviour is Now() keeping up with the host clock to within a
+ * tick, and "PASS".
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "os.h"
+#include "port.h"
+
+#define ROUNDS   5
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void Task_Nothing()
+{
+}
+
+void Task_Reprogram()
+{
+	double t0 = now_ms();
+	unsigned int n0 = Now();
+	double host;
+	unsigned int rtos;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		Disable_Interrupt();
+		while (!Timer_Window_Ended()) {
+		}
+		Task_Create_RR(Task_Nothing, 0);
+		Enable_Interrupt();
+		// let it terminate, so that the next window is a long one again
+		Task_Next();
+	}
+
+	host = now_ms() - t0;
+	rtos = Now() - n0;
+	printf("%d windows: host %.0f ms, Now() %u ms\n", ROUNDS, host, rtos);
+	if (rtos + MSECPERTICK < host || rtos > host + MSECPERTICK) {
+		printf("FAIL\n");
+		exit(1);
+	}
+	printf("PASS\n");
+	exit(0);
+}
+
+void a_main()
+{
+	Task_Create_RR(Task_Reprogram, 0);
+}
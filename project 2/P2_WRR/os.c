@@ -1,9 +1,7 @@
 #include <string.h>
-#include "avr/io.h"
-#include "avr/interrupt.h"
-#define F_CPU 16000000
-#include "util/delay.h"
 #include "os.h"
+#include "port.h"
+#include "tlsf.h"
 /**
 * \file os.c
 * \brief A Skeleton Implementation of an RTOS
@@ -23,7 +21,8 @@
 *
 * \section Implementation Note
 * This example uses the ATMEL AT90USB1287 instruction set as an example
-* for implementing the context switching mechanism.
+* for implementing the context switching mechanism. All hardware specific
+* code is behind "port.h", so that the kernel also runs on a Linux host.
 * This code is ready to be loaded onto an AT90USBKey.  Once loaded the
 * RTOS scheduling code will alternate lighting of the GREEN LED light on
 * LED D2 and D5 whenever the correspoing PING and PONG tasks are running.
@@ -34,6 +33,32 @@
 // run our RTOS - will come from either remote or base.c
 extern void a_main();
 
+#if IRQ_TRACE
+/*
+* Every Disable_Interrupt() in this file opens an interrupts-off window, unless
+* interrupts were off already, and the Enable_Interrupt() or Restore_Interrupt()
+* that turns them back on closes it. See Irq_GetStats().
+*/
+static void Trace_Irq_Off(unsigned int line);
+static void Trace_Irq_On(unsigned int line);
+
+static inline void Port_Disable_Interrupt(void) { Disable_Interrupt(); }
+static inline void Port_Enable_Interrupt(void) { Enable_Interrupt(); }
+static inline void Port_Restore_Interrupt(IRQ_STATE s) { Restore_Interrupt(s); }
+
+#undef Disable_Interrupt
+#undef Enable_Interrupt
+#undef Restore_Interrupt
+#define Disable_Interrupt()   do { IRQ_STATE s_ = Save_Interrupt(); Port_Disable_Interrupt(); \
+                                   if (Interrupts_Enabled(s_)) Trace_Irq_Off(__LINE__); } while (0)
+#define Enable_Interrupt()    do { Trace_Irq_On(__LINE__); Port_Enable_Interrupt(); } while (0)
+#define Restore_Interrupt(s)  do { IRQ_STATE s_ = (s); if (Interrupts_Enabled(s_)) Trace_Irq_On(__LINE__); \
+                                   Port_Restore_Interrupt(s_); } while (0)
+#else
+#define Trace_Irq_Off(line)
+#define Trace_Irq_On(line)
+#endif
+
 typedef void (*voidfuncptr) (void);      /* pointer to void f(void) */
 
 
@@ -54,13 +79,19 @@ typedef void (*voidfuncptr) (void);      /* pointer to void f(void) */
 * After executing the bottom half, the context of Cp is saved and the context
 * of the kernel is restore. Hence, when this function returns, kernel is active
 * again, but Cp is not running any more.
+* It returns the system call Cp has made, i.e. the argument Cp passed to
+* Enter_Kernel(), which is NULL if Cp has been preempted.
 * (See file "switch.S" for details.)
 */
-extern void CSwitch();
-extern void Exit_Kernel();    /* this is the same as CSwitch() */
+struct KernelCall;
+extern struct KernelCall *CSwitch();
+extern struct KernelCall *Exit_Kernel();    /* this is the same as CSwitch() */
 
 /* Prototype */
 void Task_Terminate(void);
+void Timer_Program(void);
+TICK Timer_Passed(void);
+void Kernel_Tick(TICK elapsed);
 
 /**
 * This external function could be implemented in two ways:
@@ -72,13 +103,29 @@ void Task_Terminate(void);
 *     This is the case if it is implemented by software interrupt. However,
 *     as an external function call, it must be done explicitly. When Enter_Kernel()
 *     returns, then interrupts will be re-enabled by Enter_Kernel().
+*  The system call is passed in r25:r24 like any first argument, and handed to
+*  the kernel as the return value of Exit_Kernel().
+*/
+extern void Enter_Kernel(struct KernelCall *call);
+
+/**
+* Same as Enter_Kernel(), but only saves the registers that must survive a
+* function call. Used by the system call stubs; an interrupt preempting Cp
+* must use Enter_Kernel(), which saves the full context.
+*/
+extern void Enter_Kernel_Voluntary(struct KernelCall *call);
+
+/**
+* If STACK_WATERMARK is set, every stack is painted with STACK_PAINT when its task
+* is created, so that the bytes a task has never touched can be counted later.
+* Otherwise only the guard is painted, i.e. the lowest STACK_GUARD bytes of a
+* stack: once any of them is written, the task has reached the end of its stack.
 */
-extern void Enter_Kernel();
+#define STACK_PAINT   0xA5
+#define STACK_GUARD   4
 
-#define Disable_Interrupt()		asm volatile ("cli"::)
-#define Enable_Interrupt()		asm volatile ("sei"::)
-#define KERNEL_DEBUG_PIN PL4
-#define OS_ABORT_DEBUG_PORT PORTC
+#define TIMER_COUNTS_PER_TICK  ((unsigned long)TIMER_COUNTS_PER_MS * MSECPERTICK)
+#define TICKLESS_MAX_TICKS     ((TICK)(0xFFFFUL / TIMER_COUNTS_PER_TICK))
 
 
 /**
@@ -106,7 +153,19 @@ typedef enum kernel_request_type
 	CHAN_INIT,
 	CHAN_SEND,
 	CHAN_RECV,
-	CHAN_WRITE
+	CHAN_WRITE,
+	CHAN_RECV_ANY,
+	SLEEP,
+	POOL_WAIT,
+	POOL_FREE,
+	MUTEX_LOCK,
+	MUTEX_UNLOCK,
+	SEM_WAIT,
+	SEM_SIGNAL,
+	EVENT_WAIT,
+	EVENT_SET,
+	NOTIFY_WAIT,
+	NOTIFY
 } KERNEL_REQUEST_TYPE;
 
 typedef enum priorities
@@ -117,67 +176,205 @@ typedef enum priorities
 	IDLE_TASK
 } PRIORITIES;
 
+/**
+* A system call. The stub builds it in its own stack frame and passes its address
+* to Enter_Kernel(), and the kernel writes the result back into it. It stays valid
+* while the task is blocked in the call, so the task that unblocks it can deliver
+* the result too.
+*/
+typedef struct KernelCall
+{
+	KERNEL_REQUEST_TYPE request;
+	int result;
+	union {
+		struct {
+			voidfuncptr f;
+			int arg;
+			PRIORITIES py;
+			TICK period;
+			TICK wcet;
+			TICK offset;
+			WEIGHT w;
+			unsigned int stack_size;
+		} create;
+		struct {
+			CHAN ch;
+			int v;
+			BOOL msg;    /* "v" is a message of the message pool */
+			const CHAN *set;   /* the channels of a Recv_Any(), "ch" is the one received from */
+			unsigned int n;
+			struct WaitNode *nodes;   /* one per channel the receiver waits on */
+			TICK timeout;      /* 0: never block, WAIT_FOREVER: no timeout */
+			BOOL timed_out;
+		} chan;
+		TICK sleep;
+		struct {
+			POOL pool;
+			void *block;     /* the block freed, or the block allocated */
+		} pool;
+		struct {
+			MUTEX m;
+			struct WaitNode *node;   /* the waiting task among the mutex's waiters */
+		} mutex;
+		struct {
+			unsigned int id;         /* the SEM or the EVENT, or the PID notified */
+			unsigned int flags;      /* of an EVENT, the ones set or waited for; of a notification, its value or the bits cleared on exit */
+			unsigned int mode;       /* EVENT_ALL, EVENT_CLEAR, or the NOTIFY_* action */
+			struct WaitNode *node;
+			TICK timeout;            /* 0: never block, WAIT_FOREVER: no timeout */
+			BOOL timed_out;
+		} sync;
+	} args;
+} KERNEL_CALL;
+
 /**
 * Each task is represented by a process descriptor, which contains all
-* relevant information about this task. For convenience, we also store
-* the task's stack, i.e., its workspace, in here.
+* relevant information about this task. The task's stack, i.e., its
+* workspace, is carved out of the stack arena when the task is created.
+* The fields used on every tick and dispatch come first, and the whole PD
+* stays within the 63 byte displacement of the AVR's LDD/STD, so the kernel
+* can reach any field straight from the PD pointer.
 */
 typedef struct ProcessDescriptor
 {
-	PID pid;
-	PRIORITIES py;
-	WEIGHT w;
-	volatile unsigned char *sp;   /* stack pointer into the "workSpace" */
-	unsigned char workSpace[WORKSPACE];
+	volatile unsigned char *sp;   /* stack pointer into the "stack" */
 	PROCESS_STATES state;
-	voidfuncptr  code;   /* function to be executed as a task */
-	KERNEL_REQUEST_TYPE request;
-	int arg;
-	int kernel_response;
-	CHAN comm_chan;
-	int kernel_chan_arg;
+	PRIORITIES py;                /* the one it runs at, higher than "base_py" while it inherits one */
+	TICK executed_ticks;          /* quantum of a RR task, or time used by a periodic task */
+	WEIGHT w;
+
+	// Links of the ready queue, or the queue of a pool, the task is on
+	volatile struct ProcessDescriptor *rq_next;
+	volatile struct ProcessDescriptor *rq_prev;
 
 	// Atrributes for time-based tasks
-	TICK period;
 	TICK wcet;
-	TICK offset;
-	TICK next_schedule;
-	TICK executed_ticks;
-	TICK remaining_ticks;
+	TICK period;
+
+	// Delta queue links, i.e. the release queue of time-based tasks or the sleep queue
+	volatile struct ProcessDescriptor *dq_next;
+	volatile struct ProcessDescriptor *dq_prev;
+	TICK dq_delta;      /* ticks after the previous PD in the queue */
 
-	PRIORITIES py_arg;
-	TICK period_arg;
-	TICK wcet_arg;
-	TICK offset_arg;
+	PID pid;
+	unsigned char *stack;         /* lowest address of its workspace */
+	unsigned int stack_size;      /* in bytes */
+
+	KERNEL_CALL *call;   /* the system call the task is blocked in */
+	voidfuncptr  code;   /* function to be executed as a task */
+	int arg;
 
+	unsigned int heap_used;   /* bytes of the heap allocated by this PID, see Mem_Alloc() */
+
+	PRIORITIES base_py;              /* the one it was created with, i.e. what kind of task it is */
+	struct KernelMutex *held;        /* the mutexes it has locked */
+
+	unsigned int notify_value;       /* see Task_Notify() */
+	BOOL notify_pending;             /* notified since its last Task_Notify_Wait() */
 } PD;
 
-// Queue Implementation
+#ifdef __AVR__
+// Fails to compile if a PD field is out of LDD/STD range
+typedef char PD_FITS_LDD_RANGE[(sizeof(PD) <= 64) ? 1 : -1];
+#endif
+
+/**
+* A receiver waiting on a channel. The node lives in the stack frame of the
+* waiting task's system call, one per channel it waits on, so the task can be
+* taken off any channel in O(1), e.g. when its timeout expires.
+*/
+typedef struct WaitNode
+{
+	struct WaitNode *next;
+	struct WaitNode *prev;
+	volatile PD *pd;     /* NULL while the node is not on a list */
+} WAIT_NODE;
+
+typedef struct WaitList
+{
+	WAIT_NODE *head;
+	WAIT_NODE *tail;
+	unsigned int count;
+} WAIT_LIST;
+
+// Fails to compile if the largest frame a channel call keeps on a waiting task's
+// stack, that of Recv_Any(), could take more than half of the smallest stack
+typedef char CHAN_FRAME_FITS_MIN_STACK[(sizeof(KERNEL_CALL) + MAXRECVANY * sizeof(WAIT_NODE) <= PORT_MIN_STACK / 2) ? 1 : -1];
+
+/**
+* A ready queue, or the tasks waiting for a block of a pool. It is a doubly
+* linked list through the PDs, as a task is on one RQ at most, so a task is
+* taken out of the middle in O(1) and an empty queue is only a few bytes.
+*/
 typedef struct ReadyQueue
 {
-	volatile PD* queue[MAXPROCESS];
-	volatile int count;
-	volatile int front;
-	volatile int end;
+	volatile PD* head;
+	volatile PD* tail;
+	volatile unsigned int count;
 } RQ;
 
+/**
+* Delta queue, i.e. a list of PDs sorted by expiry where each PD stores the
+* number of ticks after its predecessor. Only the head has to be looked at on
+* a tick, and there are no absolute times to wrap around.
+*/
+typedef struct DeltaQueue
+{
+	volatile PD* head;
+} DQ;
+
+/**
+* A free block of the stack arena. The header lives in the free memory itself,
+* so a stack costs nothing on top of its size. The size of every block is a
+* multiple of sizeof(FREE_STACK).
+*/
+typedef struct FreeStack
+{
+	unsigned int size;              /* in bytes, including this header */
+	struct FreeStack *next;         /* next free block, by address */
+} FREE_STACK;
+
 /**
 * This table contains ALL process descriptors. It doesn't matter what
 * state a task is in.
 */
 static PD Process[MAXPROCESS];
 
+// The DEAD PDs, linked through "rq_next" as a DEAD task is on no RQ
+static volatile PD* FreePD;
+
+/**
+* All task stacks are allocated from here, so a small task only takes what it
+* needs. Declared as blocks so that every stack is aligned like a FREE_STACK.
+*/
+static FREE_STACK StackArena[STACK_ARENA / sizeof(FREE_STACK)];
+
+// Free blocks of StackArena, sorted by address
+static FREE_STACK *FreeStacks;
+
 // The ready queues - time based tasks can only ever have one task queued
-RQ ReadyQRR = {.count = 0, .front = 0, .end = 0};
+RQ ReadyQRR = {.head = NULL, .tail = NULL, .count = 0};
+
+RQ ReadyQTime = {.head = NULL, .tail = NULL, .count = 0};
+
+RQ ReadyQSystem = {.head = NULL, .tail = NULL, .count = 0};
+
+RQ ReadyQIdle = {.head = NULL, .tail = NULL, .count = 0};
 
-RQ ReadyQTime = {.count = 0, .front = 0, .end = 0};
+// Time-based tasks waiting for their next release, sorted by release time
+DQ ReleaseQ = {.head = NULL};
 
-RQ ReadyQSystem = {.count = 0, .front = 0, .end = 0};
+// System and RR tasks in Task_Sleep(), sorted by wake-up time
+DQ SleepQ = {.head = NULL};
 
-RQ ReadyQIdle = {.count = 0, .front = 0, .end = 0};
+// The released (READY or RUNNING) time-based task, there can only ever be one
+volatile static PD* TimeTask = NULL;
 
 volatile TICK current_tick = 0;
 
+/** number of TICKs covered by the current TIMER3 compare window */
+volatile static TICK timer_window = 1;
+
 
 /**
 * The process descriptor of the currently RUNNING task.
@@ -207,6 +404,15 @@ volatile static unsigned int NextP;
 /** 1 if kernel has been started; 0 otherwise. */
 volatile static unsigned int KernelActive;
 
+/**
+* 1 while the kernel runs on its own stack, with interrupts enabled. An ISR
+* must not touch the ready queues then, so it leaves its work to the kernel.
+*/
+volatile static unsigned char InKernel;
+
+/** ticks of timer interrupts that came while InKernel, not yet in current_tick */
+volatile static TICK DeferredTicks;
+
 /** number of tasks created so far */
 volatile static unsigned int Tasks;
 
@@ -222,9 +428,15 @@ typedef enum ChannelState {
 */
 typedef struct channel {
 	CHANNEL_STATE state;
-	PD *sender;
-	RQ receivers;
+	volatile PD *sender;
+	WAIT_LIST receivers;
 	int val;
+
+	// Ring buffer of a buffered channel, capacity is 0 for an unbuffered one
+	int *buf;
+	unsigned int capacity;
+	unsigned int head;     /* index of the oldest value */
+	unsigned int used;
 } CHANNEL;
 
 /**
@@ -234,6 +446,133 @@ static CHANNEL channels[MAXCHAN];
 
 volatile static unsigned int chanCount;
 
+/**
+* The ring buffers of all buffered channels. Channels are never freed, so a
+* buffer is simply the next "capacity" ints.
+*/
+static int ChanBuffers[CHAN_BUFFERS];
+
+volatile static unsigned int chanBuffersUsed;
+
+/**
+* A system call posted by an ISR, for the kernel to make once the ISR is done.
+*/
+typedef struct Post {
+	KERNEL_REQUEST_TYPE request;
+	unsigned int target;     /* the CHAN, POOL, SEM or EVENT, or the PID notified */
+	union {
+		int v;
+		void *block;
+	} arg;
+	unsigned int action;     /* of a NOTIFY */
+} POST;
+
+/**
+* The posts of ISRs, in a ring buffer. Only ISRs move "PostTail" and only the
+* kernel moves "PostHead", and an index is a single byte, which the AVR reads
+* and writes atomically, so neither side has to lock the other out.
+*/
+static POST Posts[ISR_POSTS];
+
+volatile static unsigned char PostHead;   /* the next post for the kernel */
+volatile static unsigned char PostTail;   /* where the next post goes */
+
+/**
+* A message of the message pool. A free message holds the link to the next one.
+*/
+typedef union MessageBuffer {
+	unsigned char data[MSG_SIZE];
+	union MessageBuffer *next;
+	long align;    /* so that any type can be stored in a message */
+} MSG_BUF;
+
+static MSG_BUF MsgPool[MSG_COUNT];
+
+// Number of owners of each message, i.e. the sender or the receivers it went to; 0 if free
+static unsigned int MsgRefs[MSG_COUNT];
+
+static MSG_BUF *FreeMsgs;
+
+/**
+* A block of a memory pool. A free block holds the link to the next one.
+*/
+typedef union PoolBlock {
+	union PoolBlock *next;
+	long align;    /* so that any type can be stored in a block */
+} POOL_BLOCK;
+
+/**
+* A memory pool of "count" blocks of "block_size" bytes, all of them in one
+* piece of PoolMemory starting at "start".
+*/
+typedef struct mempool {
+	POOL_BLOCK *free;
+	unsigned char *start;
+	unsigned int block_size;
+	unsigned int count;
+	unsigned int used;
+	unsigned int high_water;   /* the most blocks ever used at the same time */
+	unsigned int failures;     /* allocations that found the pool empty */
+	RQ waiters;                /* tasks blocked in Pool_Alloc_Wait() */
+} MEMPOOL;
+
+/**
+* This table contains ALL memory pools.
+*/
+static MEMPOOL pools[MAXPOOL];
+
+volatile static unsigned int poolCount;
+
+// The blocks of all memory pools. Pools are never freed, so a pool is simply the next piece.
+static POOL_BLOCK PoolMemory[POOL_MEMORY / sizeof(POOL_BLOCK)];
+
+volatile static unsigned int poolMemoryUsed;   /* in POOL_BLOCKs */
+
+// The heap of Mem_Alloc(), made of longs so that it is aligned for any type
+static long HeapMemory[HEAP_SIZE / sizeof(long)];
+
+static TLSF Heap;
+
+/**
+* A mutex, see Mutex_Lock(). The mutexes a task holds are linked together, so
+* that the priority it inherits can be worked out again as it unlocks one.
+*/
+typedef struct KernelMutex {
+	volatile PD *owner;                 /* NULL if it is free */
+	struct KernelMutex *next_held;      /* the owner's other mutexes */
+	struct KernelMutex *prev_held;
+	WAIT_LIST waiters;                  /* highest priority first */
+} KERNEL_MUTEX;
+
+static KERNEL_MUTEX mutexes[MAXMUTEX];
+
+volatile static unsigned int mutexCount;
+
+/**
+* A counting semaphore, see Sem_Wait().
+*/
+typedef struct KernelSem {
+	unsigned int count;
+	WAIT_LIST waiters;                  /* highest priority first */
+} KERNEL_SEM;
+
+static KERNEL_SEM sems[MAXSEM];
+
+volatile static unsigned int semCount;
+
+/**
+* A group of event flags, see Event_Wait(). The flags each waiter waits for are
+* in its system call.
+*/
+typedef struct KernelEvent {
+	unsigned int flags;
+	WAIT_LIST waiters;                  /* in the order they came */
+} KERNEL_EVENT;
+
+static KERNEL_EVENT events[MAXEVENT];
+
+volatile static unsigned int eventCount;
+
 typedef enum ErrorCodes {
 	NO_ERROR = 0,
 	ERROR_EXCEEDS_MAXPROCESS,
@@ -241,26 +580,39 @@ typedef enum ErrorCodes {
 	ERROR_PERIODIC_BLOCK_OP,
 	ERROR_TOO_MANY_SENDERS,
 	ERROR_PERIODIC_TASK_COLLISION,
-	ERROR_WCET_VIOLATION
+	ERROR_WCET_VIOLATION,
+	ERROR_INVALID_MESSAGE,
+	ERROR_INVALID_BLOCK,
+	ERROR_ISR_POSTS_FULL,
+	ERROR_INVALID_MUTEX,
+	ERROR_MUTEX_OWNER,   /* unlocked by another task, locked twice, or held at exit or at a periodic Task_Next() */
+	ERROR_INVALID_SEM,
+	ERROR_INVALID_EVENT,
+	ERROR_RECV_ANY_SET,  /* Recv_Any() on more than MAXRECVANY channels */
+	ERROR_STACK_OVERFLOW = 0x80   /* | the PID of the task */
 } ERROR_CODES;
 
 /*
 rudimentary queueing implementation. This is used to enqueue
-and dequeue from the ready queues. If a ready queue is ever overfilled
-it is a violation and we panic and exit. This should be implemented as a
-circular array. We need 2 integer indexes, one represents the front, one the end.
-When we enqueue, we move the end forwards, wrapping around. When we dequeue,
-we move the front forwards, wrapping around.
+and dequeue from the ready queues. We enqueue at the tail and dequeue
+from the head, so a queue is first-come-first-served. A task that is
+queued again before it has been dequeued is a violation, and we panic
+and exit.
 */
 void enqueue(volatile RQ* q, volatile PD* p)
 {
-	if (q->count == MAXPROCESS){
-		// #TODO make this error code useful!
+	if (p->rq_prev != NULL || q->head == p){
 		OS_Abort(12);
 	}
-	q->queue[q->end] = p;
+	p->rq_next = NULL;
+	p->rq_prev = q->tail;
+	if (q->tail != NULL) {
+		q->tail->rq_next = p;
+	} else {
+		q->head = p;
+	}
+	q->tail = p;
 	q->count++;
-	q->end = (q->end + 1) % MAXPROCESS;
 }
 
 volatile PD* dequeue(volatile RQ* q)
@@ -268,9 +620,15 @@ volatile PD* dequeue(volatile RQ* q)
 	if (q->count == 0){
 		OS_Abort(13);
 	}
-	volatile PD* result = q->queue[q->front];
+	volatile PD* result = q->head;
+	q->head = result->rq_next;
+	if (q->head != NULL) {
+		q->head->rq_prev = NULL;
+	} else {
+		q->tail = NULL;
+	}
+	result->rq_next = NULL;
 	q->count--;
-	q->front = (q->front + 1) % MAXPROCESS;
 	return result;
 }
 
@@ -279,6 +637,223 @@ volatile int count(volatile RQ* q)
 	return q->count;
 }
 
+// Takes "p" out of the middle of "q", if it is there. The tasks behind it keep their order.
+void rq_remove(volatile RQ* q, volatile PD* p)
+{
+	if (p->rq_prev != NULL) {
+		p->rq_prev->rq_next = p->rq_next;
+	} else if (q->head == p) {
+		q->head = p->rq_next;
+	} else {
+		return;
+	}
+	if (p->rq_next != NULL) {
+		p->rq_next->rq_prev = p->rq_prev;
+	} else {
+		q->tail = p->rq_prev;
+	}
+	p->rq_next = NULL;
+	p->rq_prev = NULL;
+	q->count--;
+}
+
+/*
+Wait list implementation. It is first-come-first-served like the ready queues,
+but a node can also be taken out of the middle of the list.
+*/
+void wl_enqueue(WAIT_LIST* l, WAIT_NODE* n, volatile PD* p)
+{
+	n->pd = p;
+	n->next = NULL;
+	n->prev = l->tail;
+	if (l->tail != NULL) {
+		l->tail->next = n;
+	} else {
+		l->head = n;
+	}
+	l->tail = n;
+	l->count++;
+}
+
+// Puts "n" after the nodes of tasks of the same or a higher priority than "p"
+void wl_insert_by_py(WAIT_LIST* l, WAIT_NODE* n, volatile PD* p)
+{
+	WAIT_NODE *prev = l->tail;
+
+	while (prev != NULL && prev->pd->py > p->py) prev = prev->prev;
+	n->pd = p;
+	n->prev = prev;
+	n->next = (prev != NULL) ? prev->next : l->head;
+	if (n->next != NULL) {
+		n->next->prev = n;
+	} else {
+		l->tail = n;
+	}
+	if (prev != NULL) {
+		prev->next = n;
+	} else {
+		l->head = n;
+	}
+	l->count++;
+}
+
+// Does nothing if "n" is not on the list any more
+void wl_remove(WAIT_LIST* l, WAIT_NODE* n)
+{
+	if (n->pd == NULL) return;
+	if (n->prev != NULL) {
+		n->prev->next = n->next;
+	} else {
+		l->head = n->next;
+	}
+	if (n->next != NULL) {
+		n->next->prev = n->prev;
+	} else {
+		l->tail = n->prev;
+	}
+	n->pd = NULL;
+	l->count--;
+}
+
+volatile PD* wl_dequeue(WAIT_LIST* l)
+{
+	volatile PD* result;
+	if (l->count == 0){
+		OS_Abort(13);
+	}
+	result = l->head->pd;
+	wl_remove(l, l->head);
+	return result;
+}
+
+/*
+Delta queue implementation. A PD expiring at the same time as others is
+inserted after them, so expiry is first-come-first-served.
+*/
+void dq_insert(volatile DQ* q, volatile PD* p, TICK ticks)
+{
+	volatile PD* prev = NULL;
+	volatile PD* next = q->head;
+	while (next != NULL && next->dq_delta <= ticks) {
+		ticks -= next->dq_delta;
+		prev = next;
+		next = next->dq_next;
+	}
+	p->dq_delta = ticks;
+	p->dq_next = next;
+	p->dq_prev = prev;
+	if (next != NULL) {
+		next->dq_delta -= ticks;
+		next->dq_prev = p;
+	}
+	if (prev != NULL) {
+		prev->dq_next = p;
+	} else {
+		q->head = p;
+	}
+}
+
+// O(1), as the queue is doubly linked. Does nothing if "p" is not on "q".
+void dq_remove(volatile DQ* q, volatile PD* p)
+{
+	if (p->dq_prev != NULL) {
+		p->dq_prev->dq_next = p->dq_next;
+	} else if (q->head == p) {
+		q->head = p->dq_next;
+	} else {
+		return;
+	}
+	if (p->dq_next != NULL) {
+		p->dq_next->dq_delta += p->dq_delta;
+		p->dq_next->dq_prev = p->dq_prev;
+	}
+	p->dq_next = NULL;
+	p->dq_prev = NULL;
+}
+
+// Pops the head if it expires within *elapsed ticks, which is reduced by its delta
+volatile PD* dq_pop_expired(volatile DQ* q, TICK* elapsed)
+{
+	volatile PD* p = q->head;
+	if (p == NULL || p->dq_delta > *elapsed) return NULL;
+	*elapsed -= p->dq_delta;
+	q->head = p->dq_next;
+	if (q->head != NULL) q->head->dq_prev = NULL;
+	p->dq_next = NULL;
+	return p;
+}
+
+// Moves the time base of the queue forward, after all expired PDs are popped
+void dq_advance(volatile DQ* q, TICK elapsed)
+{
+	if (q->head != NULL) {
+		q->head->dq_delta -= elapsed;
+	}
+}
+
+/*
+First-fit allocation of task stacks from StackArena. A stack is taken from the
+top of a free block, so only the block's size changes. When a stack is freed,
+it is merged with its free neighbours, so the arena does not break up into
+pieces that are too small for a new task.
+*/
+void Stack_Init()
+{
+	FreeStacks = StackArena;
+	FreeStacks->size = sizeof(StackArena);
+	FreeStacks->next = NULL;
+}
+
+// Allocates at least *size bytes, *size is set to the size actually allocated
+unsigned char *Stack_Alloc(unsigned int *size)
+{
+	FREE_STACK **link = &FreeStacks;
+	FREE_STACK *b;
+	unsigned int want = *size;
+
+	if (want < PORT_MIN_STACK) want = PORT_MIN_STACK;
+	want = (want + sizeof(FREE_STACK) - 1) / sizeof(FREE_STACK) * sizeof(FREE_STACK);
+
+	while ((b = *link) != NULL && b->size < want) {
+		link = &(b->next);
+	}
+	if (b == NULL) return NULL;
+
+	// a remainder too small for any stack goes with this one
+	if (b->size - want < PORT_MIN_STACK) {
+		*link = b->next;
+		*size = b->size;
+		return (unsigned char *)b;
+	}
+	b->size -= want;
+	*size = want;
+	return (unsigned char *)b + b->size;
+}
+
+void Stack_Free(unsigned char *stack, unsigned int size)
+{
+	FREE_STACK **link = &FreeStacks;
+	FREE_STACK *prev = NULL;
+	FREE_STACK *b = (FREE_STACK *)stack;
+
+	while (*link != NULL && *link < b) {
+		prev = *link;
+		link = &((*link)->next);
+	}
+	b->size = size;
+	b->next = *link;
+	*link = b;
+
+	if (b->next != NULL && (unsigned char *)b + b->size == (unsigned char *)b->next) {
+		b->size += b->next->size;
+		b->next = b->next->next;
+	}
+	if (prev != NULL && (unsigned char *)prev + prev->size == (unsigned char *)b) {
+		prev->size += b->size;
+		prev->next = b->next;
+	}
+}
+
 // Put the task on the correct ready queue, and set its state to ready
 void setReady(volatile PD* p)
 {
@@ -310,59 +885,45 @@ void setReady(volatile PD* p)
 /**
 * When creating a new task, it is important to initialize its stack just like
 * it has called "Enter_Kernel()"; so that when we switch to it later, we
-* can just restore its execution context on its stack.
+* can just restore its execution context on its stack. A new task always
+* starts from a FRAME_FULL context.
 * (See file "cswitch.S" for details.)
 */
 PID Kernel_Create_Task_At( volatile PD *p, voidfuncptr f, int arg, PID pid, PRIORITIES py, TICK period, TICK wcet, TICK offset, WEIGHT w)
 {
 	unsigned char *sp;
 
-	//Changed -2 to -1 to fix off by one error.
-	sp = (unsigned char *) &(p->workSpace[WORKSPACE-1]);
-
-	//Clear the contents of the workspace
-	memset(&(p->workSpace),0,WORKSPACE);
-
-	//Notice that we are placing the address (16-bit) of the functions
-	//onto the stack in reverse byte order (least significant first, followed
-	//by most significant).  This is because the "return" assembly instructions
-	//(rtn and rti) pop addresses off in BIG ENDIAN (most sig. first, least sig.
-	//second), even though the AT90 is LITTLE ENDIAN machine.
+#if STACK_WATERMARK
+	//Paint the workspace, see Task_StackUnused()
+	memset(p->stack,STACK_PAINT,p->stack_size);
+#else
+	memset(p->stack,STACK_PAINT,STACK_GUARD);
+#endif
 
-	//Store terminate at the bottom of stack to protect against stack underrun.
-	*(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
-	*(unsigned char *)sp-- = 0x00;
+	sp = Port_Init_Frame(p->stack, p->stack_size, f, Task_Terminate);
 
-	//Place return address of function at bottom of stack
-	*(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
-	*(unsigned char *)sp-- = 0x00;
-
-	//Place stack pointer at top of stack
-	sp = sp - 34;
-	// set enable interrupt
-	*(unsigned char *)(sp+1) |= (1 << 7);
-
-	p->sp = sp;		/* stack pointer into the "workSpace" */
+	p->sp = sp;		/* stack pointer into the "stack" */
 	p->code = f;		/* function to be executed as a task */
-	p->request = NONE;
+	p->call = NULL;
+	p->rq_next = NULL;
+	p->rq_prev = NULL;
 	p->arg = arg;
 	p->pid = pid;
 	p->py = py;
-	p->request = NONE;
+	p->base_py = py;
+	p->held = NULL;
+	p->notify_value = 0;
+	p->notify_pending = FALSE;
 	p->w = w;
 
-	// time-based stuff
-	//#TODO consider the current tick in this
+	// time-based stuff, the offset is relative to the time of creation
 	p->period = period;
 	p->wcet = wcet;
-	p->offset = offset;
-	p->next_schedule = offset;
 	p->executed_ticks = 0;
 
 	if (py == TIME) {
 		p->state = SUSPENDED;
+		dq_insert(&ReleaseQ, p, offset);
 		} else {
 		//put on ready queue
 		setReady(p);
@@ -374,20 +935,42 @@ PID Kernel_Create_Task_At( volatile PD *p, voidfuncptr f, int arg, PID pid, PRIO
 
 
 /**
-*  Create a new task
+*  Create a new task with a stack of at least "stack_size" bytes
 */
-static PID Kernel_Create_Task( voidfuncptr f, int arg, PRIORITIES py, TICK period, TICK wcet, TICK offset, WEIGHT w)
+static PID Kernel_Create_Task( voidfuncptr f, int arg, PRIORITIES py, TICK period, TICK wcet, TICK offset, WEIGHT w, unsigned int stack_size)
 {
-	int x;
+	volatile PD *p;
+	unsigned char *stack;
 
-	if (Tasks == MAXPROCESS) return 0;  /* Too many task! */
+	if (FreePD == NULL) return 0;       /* Too many task! */
 
-	/* find a DEAD PD that we can use  */
-	for (x = 0; x < MAXPROCESS; x++) {
-		if (Process[x].state == DEAD) break;
-	}
+	stack = Stack_Alloc(&stack_size);
+	if (stack == NULL) return 0;        /* Out of stack space! */
+
+	/* take a DEAD PD off the free list */
+	p = FreePD;
+	FreePD = p->rq_next;
 	++Tasks;
-	return Kernel_Create_Task_At( &(Process[x]), f, arg, x+1, py, period, wcet, offset, w);
+	p->stack = stack;
+	p->stack_size = stack_size;
+	return Kernel_Create_Task_At( p, f, arg, (p - Process) + 1, py, period, wcet, offset, w);
+}
+
+/**
+* Aborts if the task has used up its stack, i.e. its stack pointer is in the
+* guard or the guard has been written. It is only checked when the task enters
+* the kernel, so an overflow may have corrupted other memory by then; the guard
+* makes it likely that it is caught on the way there.
+*/
+static void Check_Stack(volatile PD* p)
+{
+	unsigned char *guard = p->stack;
+
+	if (p->sp < guard + STACK_GUARD
+		|| guard[0] != STACK_PAINT || guard[1] != STACK_PAINT
+		|| guard[2] != STACK_PAINT || guard[3] != STACK_PAINT) {
+		OS_Abort(ERROR_STACK_OVERFLOW | p->pid);
+	}
 }
 
 /**
@@ -441,507 +1024,2472 @@ static void Dispatch()
 /**
 * Initializes the channel and its values
 */
-CHAN Kernel_Chan_Init()
+CHAN Kernel_Chan_Init(unsigned int capacity)
 {
 	if (chanCount >= MAXCHAN) {
 		// No available channels - Print error and NO-OP/continue
 		OS_Abort(ERROR_EXCEEDS_MAXCHAN);
-		return NULL;
+		return 0;
+		} else if (capacity > CHAN_BUFFERS - chanBuffersUsed) {
+		// Not enough buffer space left
+		return 0;
 		} else {
 		channels[chanCount].state = IDLE;
 		channels[chanCount].receivers.count = 0;
-		channels[chanCount].receivers.front = NULL;
-		channels[chanCount].receivers.end = NULL;
+		channels[chanCount].receivers.head = NULL;
+		channels[chanCount].receivers.tail = NULL;
+		channels[chanCount].buf = &(ChanBuffers[chanBuffersUsed]);
+		channels[chanCount].capacity = capacity;
+		channels[chanCount].head = 0;
+		channels[chanCount].used = 0;
+		chanBuffersUsed += capacity;
 		return ++chanCount;
 	}
 }
 
-void Kernel_Chan_Send()
+/**
+* Blocks Cp in the channel call "call" until another task completes it, or
+* until its timeout expires, see Kernel_Chan_Timeout().
+*/
+static void Kernel_Chan_Block(KERNEL_CALL *call)
 {
-	if (Cp->py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
-
-	CHANNEL *chan = &(channels[Cp->comm_chan-1]);
-
-	// Check that the channel has been initialized
-	if (chan->state == NOT_INIT) OS_Abort(2);
-
-	if (chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
-
-	chan->val = Cp->kernel_chan_arg;
-	if (chan->state == RECEIVER_WAIT) {
-		// Send value & remove recipient from queue
-		while (count(&(chan->receivers)) > 0){
-			PD *receiver = dequeue(&(chan->receivers));
-			receiver->kernel_response = chan->val;
-			setReady(receiver);
-			if (receiver->py < Cp->py) {
-				setReady(Cp);
-				Dispatch();
-			}
-		}
-		chan->state = IDLE;
-		} else {
-		// Wait for a receiver...
-		chan->state = SENDER_WAIT;
-		chan->sender = Cp;
-		Cp->state = BLOCKED;
+	Cp->call = call;
+	Cp->state = BLOCKED;
+	if (call->args.chan.timeout != WAIT_FOREVER) {
+		IRQ_STATE sreg = Save_Interrupt();
+		Disable_Interrupt();
+		// SleepQ counts from the start of the current timer window
+		dq_insert(&SleepQ, Cp, call->args.chan.timeout + Timer_Passed());
+		Restore_Interrupt(sreg);
 	}
 }
 
-void Kernel_Chan_Receive()
+/**
+* The channel call "p" is blocked in has been completed by another task.
+*/
+static void Kernel_Chan_Unblock(volatile PD *p)
 {
-	if (Cp->py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
-
-	CHANNEL *chan = &(channels[Cp->comm_chan-1]);
+	if (p->call->args.chan.timeout != WAIT_FOREVER) dq_remove(&SleepQ, p);
+	setReady(p);
+}
 
-	// Check that the channel has been initialized
-	if (chan->state == NOT_INIT) OS_Abort(2);
+/**
+* The timeout of "p", blocked in a Send() or Recv(), has expired. It gives up
+* and is taken off the channel.
+*/
+static void Kernel_Chan_Timeout(volatile PD *p)
+{
+	KERNEL_CALL *call = p->call;
+	CHANNEL *chan = &(channels[call->args.chan.ch-1]);
 
-	if (chan->state == SENDER_WAIT) {
-		Cp->kernel_response = chan->val;
-		setReady(chan->sender);
-		if (chan->sender->py < Cp->py) {
-			setReady(Cp);
-			Dispatch();
-		}
+	call->args.chan.timed_out = TRUE;
+	if (call->request == CHAN_SEND) {
+		// only one sender can be waiting
 		chan->sender = NULL;
 		chan->state = IDLE;
-		} else {
-		enqueue(&(chan->receivers), Cp);
-		chan->state = RECEIVER_WAIT;
-		Cp->state = BLOCKED;
+	} else {
+		wl_remove(&(chan->receivers), call->args.chan.nodes);
+		if (chan->receivers.count == 0) chan->state = IDLE;
 	}
+	setReady(p);
 }
 
-void Kernel_Chan_Write()
+/**
+* Gives "v" to a receiver just taken off the list of "chan". A receiver waiting
+* in Recv_Any() is on the lists of its other channels too, so it is taken off
+* those, and told which channel "v" came from.
+*/
+static void Wake_Receiver(CHANNEL *chan, volatile PD *receiver, int v)
 {
-	CHANNEL *chan = &(channels[Cp->comm_chan-1]);
-
-	// Check that the channel has been initialized
-	if (chan->state == NOT_INIT) OS_Abort(2);
-
-	if (chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
-
-	// Only write if receivers waiting
-	if (chan->state == RECEIVER_WAIT) {
-		chan->val = Cp->kernel_chan_arg;
-		// Send value & remove recipient from queue
-		while (count(&(chan->receivers)) > 0){
-			PD *receiver = dequeue(&(chan->receivers));
-			receiver->kernel_response = chan->val;
-			setReady(receiver);
-			if (receiver->py < Cp->py) {
-				setReady(Cp);
-				Dispatch();
-			}
+	KERNEL_CALL *call = receiver->call;
+	unsigned int i;
+
+	call->result = v;
+	if (call->request == CHAN_RECV_ANY) {
+		call->args.chan.ch = (chan - channels) + 1;
+		for (i = 0; i < call->args.chan.n; i++) {
+			CHANNEL *other = &(channels[call->args.chan.set[i]-1]);
+			wl_remove(&(other->receivers), &(call->args.chan.nodes[i]));
+			if (other->state == RECEIVER_WAIT && other->receivers.count == 0) other->state = IDLE;
 		}
-		chan->state = IDLE;
 	}
+	Kernel_Chan_Unblock(receiver);
 }
 
 /**
-* This internal kernel function is the "main" driving loop of this full-served
-* model architecture. Basically, on OS_Start(), the kernel repeatedly
-* requests the next user task's next system call and then invokes the
-* corresponding kernel function on its behalf.
-*
-* This is the main loop of our kernel, called by OS_Start().
+* Wakes every receiver waiting on "chan" with "v", all in one pass, and returns
+* the highest priority among them. The caller then decides only once whether
+* they preempt Cp.
 */
-static void Next_Kernel_Request()
+static PRIORITIES Wake_Receivers(CHANNEL *chan, int v)
 {
-	Dispatch();  /* select a new task to run */
-
-	while(1) {
-		Cp->request = NONE; /* clear its request */
+	PRIORITIES py = IDLE_TASK;
 
-		/* activate this newly selected task */
-		CurrentSp = Cp->sp;
-		Exit_Kernel();    /* or CSwitch() */
+	while (chan->receivers.count > 0) {
+		volatile PD *receiver = wl_dequeue(&(chan->receivers));
+		if (receiver->py < py) py = receiver->py;
+		Wake_Receiver(chan, receiver, v);
+	}
+	chan->state = IDLE;
+	return py;
+}
 
-		/* if this task makes a system call, it will return to here! */
+/**
+* Resumes the sender waiting on "chan", its value has been taken.
+*/
+static void Wake_Sender(CHANNEL *chan)
+{
+	volatile PD *sender = chan->sender;
+	chan->sender = NULL;
+	chan->state = IDLE;
+	Kernel_Chan_Unblock(sender);
+}
 
-		/* save the Cp's stack pointer */
-		Cp->sp = CurrentSp;
+/*
+Ring buffer of a buffered channel. The caller checks that there is a value to
+get, or space to put one.
+*/
+static void ring_put(CHANNEL *chan, int v)
+{
+	unsigned int tail = chan->head + chan->used;
+	if (tail >= chan->capacity) tail -= chan->capacity;
+	chan->buf[tail] = v;
+	chan->used++;
+}
 
-		//#TODO need to implement suspend so a time based task can give up CPU to resume
-		// on the correct tick. What this will look like:
-		// all tasks call task_next to give up CPU
-		// if task was timed, then it suspends
-		// else behaves as it does now
-		// Every tick when we are in the kernel, we increment a TICK counter
-		// Then we check all tasks with py = TIME for what their next tick
-		// should be. If there is one that should be scheduled this tick, we
-		// call setReady on it, and then continue to the scheduler
-		// NOTE: This should ONLY EVER happen on a KERNEL TICK and not if a user
-		// process is making a kernel request, so this should be specific to the
-		// NONE case below I think
-		switch(Cp->request){
-			case CREATE:
-			//  PORTA |= (1<<PA0);
-			Kernel_Create_Task( Cp->code, Cp->arg, Cp->py_arg, Cp->period_arg, Cp->wcet_arg, Cp->offset_arg, Cp->w);
-			// If we just created a system or timed task, call dispatch
-			if (Cp->py_arg < RR && Cp->py_arg < Cp->py){
-				//#TODO we also set ready in kernel_create_task, but I think this
-				// is correct as in create we set ready the new task, but this should
-				// set ready the task we are about to context-switch out of
+static int ring_get(CHANNEL *chan)
+{
+	int v = chan->buf[chan->head];
+	if (++chan->head == chan->capacity) chan->head = 0;
+	chan->used--;
+	return v;
+}
+
+/**
+* Send() or Write() of "v" on a buffered channel. A waiting receiver gets "v"
+* right away, as the buffer must be empty. Otherwise "v" is buffered, and only
+* if the buffer is full, a Send() blocks and a Write() or a Send() with a
+* timeout of 0 drops "v".
+* Each value is received by one receiver only. Returns FALSE if "v" is dropped.
+*/
+static BOOL Kernel_Ring_Put(CHANNEL *chan, KERNEL_CALL *call)
+{
+	int v = call->args.chan.v;
+
+	if (chan->state == RECEIVER_WAIT) {
+		volatile PD *receiver = wl_dequeue(&(chan->receivers));
+		if (chan->receivers.count == 0) chan->state = IDLE;
+		Wake_Receiver(chan, receiver, v);
+		if (receiver->py < Cp->py) {
+			setReady(Cp);
+			Dispatch();
+		}
+	} else if (chan->used < chan->capacity) {
+		ring_put(chan, v);
+	} else if (call->request == CHAN_SEND && call->args.chan.timeout != 0) {
+		if (chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
+		// Wait for a receiver to make room
+		chan->val = v;
+		chan->state = SENDER_WAIT;
+		chan->sender = Cp;
+		Kernel_Chan_Block(call);
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+* Recv() on a buffered channel, it only blocks if the buffer is empty. Taking a
+* value makes room for the value of a waiting sender, which is then resumed.
+*/
+static void Kernel_Ring_Get(CHANNEL *chan, KERNEL_CALL *call)
+{
+	if (chan->used > 0) {
+		call->result = ring_get(chan);
+		if (chan->state == SENDER_WAIT) {
+			volatile PD *sender = chan->sender;
+			ring_put(chan, chan->val);
+			Wake_Sender(chan);
+			if (sender->py < Cp->py) {
 				setReady(Cp);
 				Dispatch();
 			}
-			//  PORTA &= ~(1<<PA0);
-			break;
-			case NEXT:
-			case NONE:
-			//  PORTA |= (1<<PA1);
-			/* NONE could be caused by a timer interrupt */
-			setReady(Cp);
-			Dispatch();
-			// PORTA &= ~(1<<PA1);
-			break;
-			case NEXT_TIME:
-			//  PORTA |= (1<<PA2);
-			Cp->executed_ticks = 0;
-			Cp->state = SUSPENDED;
-			Dispatch();
-			//  PORTA &= ~(1<<PA2);
-			break;
-			case TERMINATE:
-			//  PORTA |= (1<<PA4);
-			/* deallocate all resources used by this task */
-			Cp->state = DEAD;
-			Tasks--;
-			Dispatch();
-			// PORTA &= ~(1<<PA4);
-			break;
-			case CHAN_INIT:
-			// PORTA |= (1<<PA5);
-			Cp->kernel_response = Kernel_Chan_Init();
-			// PORTA &= ~(1<<PA5);
-			break;
-			case CHAN_SEND:
-			// PORTA |= (1<<PA6);
-			Kernel_Chan_Send();
-			if (Cp->state == BLOCKED) Dispatch();
-			// PORTA &= ~(1<<PA6);
-			break;
-			case CHAN_RECV:
-			//  PORTA |= (1<<PA7);
-			Kernel_Chan_Receive();
-			if (Cp->state == BLOCKED) Dispatch();
-			// PORTA &= ~(1<<PA7);
-			break;
-			case CHAN_WRITE:
-			//  PORTA |= (1<<PA3);
-			Kernel_Chan_Write();
-			// PORTA &= ~(1<<PA3);
-			break;
-			default:
-			/* Houston! we have a problem here! */
-			break;
 		}
+	} else if (call->args.chan.timeout == 0) {
+		call->args.chan.timed_out = TRUE;
+	} else {
+		wl_enqueue(&(chan->receivers), call->args.chan.nodes, Cp);
+		chan->state = RECEIVER_WAIT;
+		Kernel_Chan_Block(call);
+	}
+}
+
+/*
+Message pool. A message is passed over a CHAN as its index + 1, and only the
+reference count changes hands: the sender owns a message it got from
+Msg_Alloc(), and sending it gives its reference to the receiver(s).
+*/
+void Msg_Init()
+{
+	int x;
+	FreeMsgs = NULL;
+	for (x = MSG_COUNT - 1; x >= 0; x--) {
+		MsgRefs[x] = 0;
+		MsgPool[x].next = FreeMsgs;
+		FreeMsgs = &(MsgPool[x]);
+	}
+}
+
+// Returns the message with value "v", aborts if there is none
+static MSG_BUF *Msg_Of(int v)
+{
+	if (v <= 0 || v > MSG_COUNT || MsgRefs[v-1] == 0) OS_Abort(ERROR_INVALID_MESSAGE);
+	return &(MsgPool[v-1]);
+}
+
+// Returns the value of a message when it is sent, aborts if it is not one
+static int Msg_Value(void *msg)
+{
+	MSG_BUF *m = (MSG_BUF *)msg;
+	if (m < MsgPool || m >= MsgPool + MSG_COUNT || MsgRefs[m - MsgPool] == 0) {
+		OS_Abort(ERROR_INVALID_MESSAGE);
+	}
+	return (m - MsgPool) + 1;
+}
+
+/**
+* Drops one reference of the message with value "v", and frees it after the last one.
+* An ISR may free or allocate a message while the kernel is in here, hence the lock.
+*/
+static void Msg_Release(int v)
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	MSG_BUF *m;
+	Disable_Interrupt();
+	m = Msg_Of(v);
+	if (--MsgRefs[v-1] == 0) {
+		m->next = FreeMsgs;
+		FreeMsgs = m;
+	}
+	Restore_Interrupt(sreg);
+}
+
+/**
+* A message with value "v" has just been multicast to "n" receivers, which now
+* own it instead of the sender.
+*/
+static void Msg_Delivered(int v, unsigned int n)
+{
+	if (n == 0) {
+		Msg_Release(v);   // nobody got it
+	} else {
+		IRQ_STATE sreg = Save_Interrupt();
+		Disable_Interrupt();
+		Msg_Of(v);
+		MsgRefs[v-1] = n;
+		Restore_Interrupt(sreg);
+	}
+}
+
+/*
+Fixed-block memory pools. All operations are O(1): a block is taken from the
+head of the free list, and a freed block is pushed back, or handed straight to
+the first task waiting for one. They only need interrupts disabled, so they can
+be called from an ISR.
+*/
+POOL Kernel_Pool_Create(unsigned int block_size, unsigned int count)
+{
+	MEMPOOL *pool;
+	unsigned int units, x;
+
+	if (poolCount >= MAXPOOL || count == 0) return 0;
+	// every block is a whole number of POOL_BLOCKs, to keep them aligned
+	units = (block_size + sizeof(POOL_BLOCK) - 1) / sizeof(POOL_BLOCK);
+	if (units == 0) units = 1;
+	if (count > (sizeof(PoolMemory) / sizeof(POOL_BLOCK) - poolMemoryUsed) / units) return 0;
+
+	pool = &(pools[poolCount]);
+	pool->start = (unsigned char *)&(PoolMemory[poolMemoryUsed]);
+	pool->block_size = units * sizeof(POOL_BLOCK);
+	pool->count = count;
+	pool->used = 0;
+	pool->high_water = 0;
+	pool->failures = 0;
+	pool->waiters.head = NULL;
+	pool->waiters.tail = NULL;
+	pool->waiters.count = 0;
+	pool->free = NULL;
+	for (x = count; x > 0; x--) {
+		POOL_BLOCK *b = &(PoolMemory[poolMemoryUsed + (x-1) * units]);
+		b->next = pool->free;
+		pool->free = b;
+	}
+	poolMemoryUsed += count * units;
+	return ++poolCount;
+}
+
+// Returns the pool "p", aborts if there is none
+static MEMPOOL *Pool_Of(POOL p)
+{
+	if (p == 0 || p > poolCount) OS_Abort(ERROR_INVALID_BLOCK);
+	return &(pools[p-1]);
+}
+
+// Takes a block, or returns NULL and counts a failure if the pool is empty
+static void *Kernel_Pool_Alloc(MEMPOOL *pool)
+{
+	POOL_BLOCK *b = pool->free;
+	if (b == NULL) {
+		pool->failures++;
+		return NULL;
+	}
+	pool->free = b->next;
+	if (++pool->used > pool->high_water) pool->high_water = pool->used;
+	return b;
+}
+
+/**
+* Frees "block", or hands it over to the first task waiting for one.
+* Returns the task that has been made ready, if any.
+*/
+static volatile PD *Kernel_Pool_Free(MEMPOOL *pool, void *block)
+{
+	volatile PD *waiter;
+	POOL_BLOCK *b = (POOL_BLOCK *)block;
+
+	if ((unsigned char *)b < pool->start || (unsigned char *)b >= pool->start + pool->count * pool->block_size) {
+		OS_Abort(ERROR_INVALID_BLOCK);
+	}
+	if (count(&(pool->waiters)) == 0) {
+		b->next = pool->free;
+		pool->free = b;
+		pool->used--;
+		return NULL;
+	}
+	waiter = dequeue(&(pool->waiters));
+	waiter->call->args.pool.block = block;
+	setReady(waiter);
+	return waiter;
+}
+
+/**
+* Cp waits for a block of the pool in call->args.pool.pool. The stub has found
+* the pool empty, but an ISR may have freed a block since. Must be called with
+* interrupts disabled.
+*/
+void Kernel_Pool_Wait(KERNEL_CALL *call)
+{
+	MEMPOOL *pool = Pool_Of(call->args.pool.pool);
+
+	if (Cp->base_py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	if (pool->free != NULL) {
+		call->args.pool.block = Kernel_Pool_Alloc(pool);
+		return;
+	}
+	enqueue(&(pool->waiters), Cp);
+	Cp->call = call;
+	Cp->state = BLOCKED;
+}
+
+/*
+Mutexes with priority inheritance. The owner of a mutex runs at the highest
+priority of the tasks waiting for it, on the ready queue of that priority.
+Locking a free mutex and unlocking one without waiters is done by the stubs;
+the kernel only sees the contended cases.
+*/
+MUTEX Kernel_Mutex_Init()
+{
+	KERNEL_MUTEX *mutex;
+
+	if (mutexCount >= MAXMUTEX) return 0;
+	mutex = &(mutexes[mutexCount]);
+	mutex->owner = NULL;
+	mutex->next_held = NULL;
+	mutex->prev_held = NULL;
+	mutex->waiters.head = NULL;
+	mutex->waiters.tail = NULL;
+	mutex->waiters.count = 0;
+	return ++mutexCount;
+}
+
+// Returns the mutex "m", aborts if there is none
+static KERNEL_MUTEX *Mutex_Of(MUTEX m)
+{
+	if (m == 0 || m > mutexCount) OS_Abort(ERROR_INVALID_MUTEX);
+	return &(mutexes[m-1]);
+}
+
+// "p" becomes the owner of the free "mutex"
+static void Mutex_Take(KERNEL_MUTEX *mutex, volatile PD *p)
+{
+	mutex->owner = p;
+	mutex->prev_held = NULL;
+	mutex->next_held = p->held;
+	if (p->held != NULL) p->held->prev_held = mutex;
+	p->held = mutex;
+}
+
+// The owner lets go of "mutex", which is then free
+static void Mutex_Give(KERNEL_MUTEX *mutex)
+{
+	volatile PD *p = mutex->owner;
+
+	if (mutex->prev_held != NULL) {
+		mutex->prev_held->next_held = mutex->next_held;
+	} else {
+		p->held = mutex->next_held;
+	}
+	if (mutex->next_held != NULL) mutex->next_held->prev_held = mutex->prev_held;
+	mutex->owner = NULL;
+}
+
+static volatile RQ *Ready_Queue(PRIORITIES py)
+{
+	switch (py) {
+		case SYSTEM:
+		return &ReadyQSystem;
+		case TIME:
+		return &ReadyQTime;
+		case RR:
+		return &ReadyQRR;
+		default:
+		return &ReadyQIdle;
+	}
+}
+
+static KERNEL_SEM *Sem_Of(SEM s);
+
+/**
+* "p" holds a mutex that a task of priority "py" waits for, so it runs at "py"
+* from now on if that is higher. If "p" waits for a semaphore, it moves up among
+* its waiters, as they are woken by priority. If "p" waits for a mutex itself, it
+* moves up among that mutex's waiters and the owner of that one inherits "py" too.
+* The other waiters, of channels, events and pools, are woken in the order they
+* came. A periodic owner is never SUSPENDED or BLOCKED, see Kernel_Mutex_Lock().
+*/
+static void Mutex_Inherit(volatile PD *p, PRIORITIES py)
+{
+	KERNEL_MUTEX *mutex;
+
+	while (py < p->py) {
+		if (p->state == READY) {
+			rq_remove(Ready_Queue(p->py), p);
+			p->py = py;
+			setReady(p);
+		} else {
+			p->py = py;
+		}
+		if (p->state != BLOCKED || p->call == NULL) return;
+		if (p->call->request == SEM_WAIT) {
+			KERNEL_SEM *sem = Sem_Of(p->call->args.sync.id);
+			wl_remove(&(sem->waiters), p->call->args.sync.node);
+			wl_insert_by_py(&(sem->waiters), p->call->args.sync.node, p);
+			return;
+		}
+		if (p->call->request != MUTEX_LOCK) return;
+		mutex = Mutex_Of(p->call->args.mutex.m);
+		wl_remove(&(mutex->waiters), p->call->args.mutex.node);
+		wl_insert_by_py(&(mutex->waiters), p->call->args.mutex.node, p);
+		p = mutex->owner;
+	}
+}
+
+/**
+* The priority "p" runs at: its own, or the highest one of the tasks waiting
+* for the mutexes it still holds.
+*/
+static PRIORITIES Mutex_Inherited_Py(volatile PD *p)
+{
+	PRIORITIES py = p->base_py;
+	KERNEL_MUTEX *mutex;
+
+	for (mutex = p->held; mutex != NULL; mutex = mutex->next_held) {
+		if (mutex->waiters.head != NULL && mutex->waiters.head->pd->py < py) {
+			py = mutex->waiters.head->pd->py;
+		}
+	}
+	return py;
+}
+
+/**
+* Cp waits for the mutex in call->args.mutex.m, which the stub has found locked
+* by another task. Periodic tasks must not block, so they may only take a free
+* mutex, and must unlock it before they Task_Next().
+*/
+void Kernel_Mutex_Lock(KERNEL_CALL *call)
+{
+	KERNEL_MUTEX *mutex = Mutex_Of(call->args.mutex.m);
+
+	if (mutex->owner == NULL) {
+		Mutex_Take(mutex, Cp);
+		return;
+	}
+	if (Cp->base_py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+	wl_insert_by_py(&(mutex->waiters), call->args.mutex.node, Cp);
+	Cp->call = call;
+	Cp->state = BLOCKED;
+	Mutex_Inherit(mutex->owner, Cp->py);
+}
+
+/**
+* Cp unlocks "mutex", which goes straight to the first waiter. Cp drops back to
+* the priority it has without it.
+*/
+void Kernel_Mutex_Unlock(KERNEL_MUTEX *mutex)
+{
+	volatile PD *waiter;
+
+	Mutex_Give(mutex);
+	Cp->py = Mutex_Inherited_Py(Cp);
+	if (mutex->waiters.count == 0) return;
+	// the first waiter has the highest priority of them, so it inherits nothing
+	waiter = wl_dequeue(&(mutex->waiters));
+	Mutex_Take(mutex, waiter);
+	setReady(waiter);
+}
+
+/*
+Counting semaphores and event flags. Like a channel call, a wait has a timeout
+and its node lives in the stack frame of the waiting task's system call. A
+signal or a set that wakes nobody, or nobody who preempts the caller, is done
+by the stub; the kernel only sees the waits that block and the wakeups that
+switch tasks.
+*/
+SEM Kernel_Sem_Init(unsigned int count)
+{
+	KERNEL_SEM *sem;
+
+	if (semCount >= MAXSEM) return 0;
+	sem = &(sems[semCount]);
+	sem->count = count;
+	sem->waiters.head = NULL;
+	sem->waiters.tail = NULL;
+	sem->waiters.count = 0;
+	return ++semCount;
+}
+
+// Returns the semaphore "s", aborts if there is none
+static KERNEL_SEM *Sem_Of(SEM s)
+{
+	if (s == 0 || s > semCount) OS_Abort(ERROR_INVALID_SEM);
+	return &(sems[s-1]);
+}
+
+EVENT Kernel_Event_Init()
+{
+	KERNEL_EVENT *event;
+
+	if (eventCount >= MAXEVENT) return 0;
+	event = &(events[eventCount]);
+	event->flags = 0;
+	event->waiters.head = NULL;
+	event->waiters.tail = NULL;
+	event->waiters.count = 0;
+	return ++eventCount;
+}
+
+// Returns the event flags "e", aborts if there are none
+static KERNEL_EVENT *Event_Of(EVENT e)
+{
+	if (e == 0 || e > eventCount) OS_Abort(ERROR_INVALID_EVENT);
+	return &(events[e-1]);
+}
+
+/**
+* Blocks Cp in the semaphore or event call "call", which is already on the
+* waiters, until it is woken or its timeout expires, see Kernel_Sync_Timeout().
+*/
+static void Kernel_Sync_Block(KERNEL_CALL *call)
+{
+	Cp->call = call;
+	Cp->state = BLOCKED;
+	if (call->args.sync.timeout != WAIT_FOREVER) {
+		IRQ_STATE sreg = Save_Interrupt();
+		Disable_Interrupt();
+		// SleepQ counts from the start of the current timer window
+		dq_insert(&SleepQ, Cp, call->args.sync.timeout + Timer_Passed());
+		Restore_Interrupt(sreg);
+	}
+}
+
+// "p" has been taken off the waiters, it got what it waited for
+static void Kernel_Sync_Unblock(volatile PD *p)
+{
+	if (p->call->args.sync.timeout != WAIT_FOREVER) dq_remove(&SleepQ, p);
+	setReady(p);
+}
+
+/**
+* The timeout of "p", blocked in a Sem_Wait(), an Event_Wait() or a
+* Task_Notify_Wait(), has expired. It gives up and is taken off the waiters.
+*/
+static void Kernel_Sync_Timeout(volatile PD *p)
+{
+	KERNEL_CALL *call = p->call;
+
+	call->args.sync.timed_out = TRUE;
+	if (call->request == SEM_WAIT) {
+		wl_remove(&(Sem_Of(call->args.sync.id)->waiters), call->args.sync.node);
+	} else if (call->request == EVENT_WAIT) {
+		wl_remove(&(Event_Of(call->args.sync.id)->waiters), call->args.sync.node);
+	}
+	setReady(p);
+}
+
+/**
+* Sem_Wait(), or a Sem_Wait_Timeout() that gives up after call->args.sync.timeout
+* ticks. Periodic tasks may only try, i.e. use a timeout of 0.
+*/
+void Kernel_Sem_Wait(KERNEL_CALL *call)
+{
+	KERNEL_SEM *sem = Sem_Of(call->args.sync.id);
+
+	if (Cp->base_py == TIME && call->args.sync.timeout != 0) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	if (sem->count > 0) {
+		sem->count--;
+		return;
+	}
+	if (call->args.sync.timeout == 0) {
+		call->args.sync.timed_out = TRUE;
+		return;
+	}
+	wl_insert_by_py(&(sem->waiters), call->args.sync.node, Cp);
+	Kernel_Sync_Block(call);
+}
+
+/**
+* Wakes the first waiter of "sem", or counts the signal if there is none.
+* Returns the task that has been made ready, if any.
+*/
+static volatile PD *Kernel_Sem_Signal(KERNEL_SEM *sem)
+{
+	volatile PD *waiter;
+
+	if (sem->waiters.count == 0) {
+		sem->count++;
+		return NULL;
+	}
+	waiter = wl_dequeue(&(sem->waiters));
+	Kernel_Sync_Unblock(waiter);
+	return waiter;
+}
+
+/**
+* The flags of "flags" that satisfy the Event_Wait() in "call": those it waits
+* for that are set, or 0 if none are, or not all of them with EVENT_ALL.
+*/
+static unsigned int Event_Match(KERNEL_CALL *call, unsigned int flags)
+{
+	unsigned int set = flags & call->args.sync.flags;
+
+	if ((call->args.sync.mode & EVENT_ALL) && set != call->args.sync.flags) return 0;
+	return set;
+}
+
+/**
+* Event_Wait(), or an Event_Wait_Timeout() that gives up after
+* call->args.sync.timeout ticks. Periodic tasks may only try.
+*/
+void Kernel_Event_Wait(KERNEL_CALL *call)
+{
+	KERNEL_EVENT *event = Event_Of(call->args.sync.id);
+	unsigned int set;
+
+	if (Cp->base_py == TIME && call->args.sync.timeout != 0) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	set = Event_Match(call, event->flags);
+	if (set != 0) {
+		call->result = set;
+		if (call->args.sync.mode & EVENT_CLEAR) event->flags &= ~set;
+		return;
+	}
+	if (call->args.sync.timeout == 0) {
+		call->args.sync.timed_out = TRUE;
+		return;
+	}
+	wl_enqueue(&(event->waiters), call->args.sync.node, Cp);
+	Kernel_Sync_Block(call);
+}
+
+/**
+* Sets "flags" of "event" and wakes every waiter that is satisfied now. The
+* flags that they clear are only cleared once all of them have seen them.
+*/
+static void Kernel_Event_Set(KERNEL_EVENT *event, unsigned int flags)
+{
+	WAIT_NODE *n, *next;
+	unsigned int clear = 0;
+
+	event->flags |= flags;
+	for (n = event->waiters.head; n != NULL; n = next) {
+		volatile PD *p = n->pd;
+		unsigned int set = Event_Match(p->call, event->flags);
+		next = n->next;
+		if (set == 0) continue;
+		p->call->result = set;
+		if (p->call->args.sync.mode & EVENT_CLEAR) clear |= set;
+		wl_remove(&(event->waiters), n);
+		Kernel_Sync_Unblock(p);
+	}
+	event->flags &= ~clear;
+}
+
+/*
+Task notifications. Every task has a notification value in its PD, which any
+task or ISR can change by PID, so no kernel object is needed. Only the task
+itself waits on it, so there is no list of waiters either.
+*/
+
+// Returns the live task "p", or NULL
+static volatile PD *Task_Of(PID p)
+{
+	if (p == 0 || p > MAXPROCESS || Process[p-1].state == DEAD) return NULL;
+	return &(Process[p-1]);
+}
+
+/**
+* Cp takes its notification value, if it has been notified, clearing the bits in
+* "clear". Returns FALSE if it has not been notified.
+*/
+static BOOL Notify_Take(KERNEL_CALL *call)
+{
+	if (!Cp->notify_pending) return FALSE;
+	call->result = Cp->notify_value;
+	Cp->notify_value &= ~call->args.sync.flags;
+	Cp->notify_pending = FALSE;
+	return TRUE;
+}
+
+/**
+* Task_Notify_Wait(), which gives up after call->args.sync.timeout ticks. The
+* stub takes the value once Cp runs again, so it gets all the bits set until then.
+* Periodic tasks may only try, i.e. use a timeout of 0.
+*/
+void Kernel_Notify_Wait(KERNEL_CALL *call)
+{
+	if (Cp->base_py == TIME && call->args.sync.timeout != 0) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	if (Cp->notify_pending) return;
+	if (call->args.sync.timeout == 0) {
+		call->args.sync.timed_out = TRUE;
+		return;
+	}
+	Kernel_Sync_Block(call);
+}
+
+/**
+* Changes the notification value of "p" by "action", and wakes "p" if it waits
+* for it. Returns "p" if it has been made ready.
+*/
+static volatile PD *Kernel_Notify(volatile PD *p, unsigned int v, unsigned int action)
+{
+	switch (action) {
+		case NOTIFY_INCREMENT:
+		p->notify_value++;
+		break;
+		case NOTIFY_OVERWRITE:
+		p->notify_value = v;
+		break;
+		default:
+		p->notify_value |= v;
+		break;
+	}
+	p->notify_pending = TRUE;
+	if (p->state != BLOCKED || p->call == NULL || p->call->request != NOTIFY_WAIT) return NULL;
+	Kernel_Sync_Unblock(p);
+	return p;
+}
+
+/**
+* Send(), or a Send_Timeout() that gives up after call->args.chan.timeout ticks.
+* Periodic tasks may only try, i.e. use a timeout of 0.
+*/
+void Kernel_Chan_Send(KERNEL_CALL *call)
+{
+	if (Cp->base_py == TIME && call->args.chan.timeout != 0) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	CHANNEL *chan = &(channels[call->args.chan.ch-1]);
+
+	// Check that the channel has been initialized
+	if (chan->state == NOT_INIT) OS_Abort(2);
+
+	if (chan->capacity > 0) {
+		if (!Kernel_Ring_Put(chan, call)) call->args.chan.timed_out = TRUE;
+		return;
+	}
+
+	if (chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
+
+	chan->val = call->args.chan.v;
+	if (chan->state == RECEIVER_WAIT) {
+		if (call->args.chan.msg) Msg_Delivered(chan->val, chan->receivers.count);
+		// Send value to all the receivers, then switch at most once
+		if (Wake_Receivers(chan, chan->val) < Cp->py) {
+			setReady(Cp);
+			Dispatch();
+		}
+		} else if (call->args.chan.timeout == 0) {
+		call->args.chan.timed_out = TRUE;
+		} else {
+		// Wait for a receiver...
+		chan->state = SENDER_WAIT;
+		chan->sender = Cp;
+		Kernel_Chan_Block(call);
+	}
+}
+
+/**
+* Recv(), or a Recv_Timeout() that gives up after call->args.chan.timeout ticks.
+* Periodic tasks may only try, i.e. use a timeout of 0.
+*/
+void Kernel_Chan_Receive(KERNEL_CALL *call)
+{
+	if (Cp->base_py == TIME && call->args.chan.timeout != 0) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	CHANNEL *chan = &(channels[call->args.chan.ch-1]);
+
+	// Check that the channel has been initialized
+	if (chan->state == NOT_INIT) OS_Abort(2);
+
+	if (chan->capacity > 0) {
+		Kernel_Ring_Get(chan, call);
+		return;
+	}
+
+	if (chan->state == SENDER_WAIT) {
+		volatile PD *sender = chan->sender;
+		call->result = chan->val;
+		Wake_Sender(chan);
+		if (sender->py < Cp->py) {
+			setReady(Cp);
+			Dispatch();
+		}
+		} else if (call->args.chan.timeout == 0) {
+		call->args.chan.timed_out = TRUE;
+		} else {
+		wl_enqueue(&(chan->receivers), call->args.chan.nodes, Cp);
+		chan->state = RECEIVER_WAIT;
+		Kernel_Chan_Block(call);
+	}
+}
+
+/**
+* Recv() on the first channel of the set that has a value or a waiting sender.
+* If there is none, Cp waits on all of them, and the first Send() or Write()
+* on any of them wakes it up, see Wake_Receiver().
+*/
+void Kernel_Chan_Recv_Any(KERNEL_CALL *call)
+{
+	unsigned int i;
+
+	if (Cp->base_py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	for (i = 0; i < call->args.chan.n; i++) {
+		CHAN ch = call->args.chan.set[i];
+		// Check that the channel has been initialized
+		if (ch == 0 || ch > MAXCHAN || channels[ch-1].state == NOT_INIT) OS_Abort(2);
+		if (channels[ch-1].used > 0 || channels[ch-1].state == SENDER_WAIT) {
+			call->args.chan.ch = ch;
+			Kernel_Chan_Receive(call);
+			return;
+		}
+	}
+	for (i = 0; i < call->args.chan.n; i++) {
+		CHANNEL *chan = &(channels[call->args.chan.set[i]-1]);
+		wl_enqueue(&(chan->receivers), &(call->args.chan.nodes[i]), Cp);
+		chan->state = RECEIVER_WAIT;
+	}
+	Kernel_Chan_Block(call);
+}
+
+void Kernel_Chan_Write(KERNEL_CALL *call)
+{
+	CHANNEL *chan = &(channels[call->args.chan.ch-1]);
+
+	// Check that the channel has been initialized
+	if (chan->state == NOT_INIT) OS_Abort(2);
+
+	if (chan->capacity > 0) {
+		if (!Kernel_Ring_Put(chan, call) && call->args.chan.msg) {
+			Msg_Release(call->args.chan.v);
+		}
+		return;
+	}
+
+	if (chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
+
+	if (call->args.chan.msg) Msg_Delivered(call->args.chan.v, chan->receivers.count);
+
+	// Only write if receivers waiting
+	if (chan->state == RECEIVER_WAIT) {
+		chan->val = call->args.chan.v;
+		// Send value to all the receivers, then switch at most once
+		if (Wake_Receivers(chan, chan->val) < Cp->py) {
+			setReady(Cp);
+			Dispatch();
+		}
+	}
+}
+
+/**
+* Returns the post an ISR fills in next, or NULL if there is no room left.
+* Post_Commit() then hands it to the kernel. Must be called with interrupts
+* disabled, as in an ISR.
+*/
+static POST *Post_Next()
+{
+	unsigned char tail = PostTail;
+	unsigned char next = (tail + 1 == ISR_POSTS) ? 0 : tail + 1;
+
+	if (next == PostHead) return NULL;
+	return &(Posts[tail]);
+}
+
+static void Post_Commit()
+{
+	unsigned char tail = PostTail;
+	// the post is complete before the kernel can see it
+	PostTail = (tail + 1 == ISR_POSTS) ? 0 : tail + 1;
+}
+
+/**
+* Write() posted by an ISR. Unlike Kernel_Chan_Write(), it never switches tasks,
+* as it runs on behalf of whichever task the ISR interrupted.
+*/
+static void Kernel_Post_Write(CHAN ch, int v)
+{
+	CHANNEL *chan;
+
+	// Check that the channel has been initialized
+	if (ch == 0 || ch > MAXCHAN || channels[ch-1].state == NOT_INIT) OS_Abort(2);
+	chan = &(channels[ch-1]);
+	if (chan->capacity == 0 && chan->state == SENDER_WAIT) OS_Abort(ERROR_TOO_MANY_SENDERS);
+
+	// every receiver of an unbuffered channel, one receiver of a buffered one
+	while (chan->state == RECEIVER_WAIT) {
+		volatile PD *receiver = wl_dequeue(&(chan->receivers));
+		if (chan->receivers.count == 0) chan->state = IDLE;
+		Wake_Receiver(chan, receiver, v);
+		if (chan->capacity > 0) return;
+	}
+	if (chan->used < chan->capacity) ring_put(chan, v);
+}
+
+/**
+* Makes the system calls posted by ISRs, in order. Returns TRUE if there were any.
+*/
+static BOOL Kernel_Drain_Posts()
+{
+	unsigned char head = PostHead;
+
+	if (head == PostTail) return FALSE;
+	do {
+		switch (Posts[head].request) {
+			case CHAN_WRITE:
+			Kernel_Post_Write(Posts[head].target, Posts[head].arg.v);
+			break;
+			case POOL_FREE:
+			Kernel_Pool_Free(Pool_Of(Posts[head].target), Posts[head].arg.block);
+			break;
+			case SEM_SIGNAL:
+			Kernel_Sem_Signal(Sem_Of(Posts[head].target));
+			break;
+			case EVENT_SET:
+			Kernel_Event_Set(Event_Of(Posts[head].target), Posts[head].arg.v);
+			break;
+			case NOTIFY:
+			// the task may have terminated since
+			if (Task_Of(Posts[head].target) != NULL) {
+				Kernel_Notify(Task_Of(Posts[head].target), Posts[head].arg.v, Posts[head].action);
+			}
+			break;
+			default:
+			break;
+		}
+		if (++head == ISR_POSTS) head = 0;
+		PostHead = head;
+	} while (head != PostTail);
+	return TRUE;
+}
+
+/**
+* Catches up on what ISRs have left to the kernel while it was busy: the ticks
+* of timer interrupts and the posts. Returns TRUE if there was anything.
+* Must be called with interrupts disabled.
+*/
+static BOOL Kernel_Drain_Deferred()
+{
+	BOOL any = Kernel_Drain_Posts();
+
+	// not counted against the quantum of an RR Cp, which may not even have run
+	if (DeferredTicks > 0) {
+		TICK elapsed = DeferredTicks;
+		DeferredTicks = 0;
+		Kernel_Tick(elapsed);
+		any = TRUE;
+	}
+	return any;
+}
+
+/**
+* TRUE if a task of a higher priority than Cp is ready, e.g. made ready by an ISR.
+*/
+static BOOL Cp_Preempted()
+{
+	if (Cp->py > SYSTEM && count(&ReadyQSystem) > 0) return TRUE;
+	if (Cp->py > TIME && count(&ReadyQTime) > 0) return TRUE;
+	return Cp->py > RR && count(&ReadyQRR) > 0;
+}
+
+/**
+* Puts Cp to sleep for "ticks" ticks. Sleeping for 0 ticks is a yield.
+*/
+void Kernel_Sleep(TICK ticks)
+{
+	IRQ_STATE sreg;
+
+	if (Cp->base_py == TIME) OS_Abort(ERROR_PERIODIC_BLOCK_OP);
+
+	if (ticks == 0) {
+		setReady(Cp);
+		return;
+	}
+	// SleepQ counts from the start of the current timer window
+	sreg = Save_Interrupt();
+	Disable_Interrupt();
+	dq_insert(&SleepQ, Cp, ticks + Timer_Passed());
+	Restore_Interrupt(sreg);
+	Cp->call = NULL;   /* not a channel timeout */
+	Cp->state = BLOCKED;
+}
+
+/**
+* This internal kernel function is the "main" driving loop of this full-served
+* model architecture. Basically, on OS_Start(), the kernel repeatedly
+* requests the next user task's next system call and then invokes the
+* corresponding kernel function on its behalf.
+*
+* This is the main loop of our kernel, called by OS_Start().
+*/
+static void Next_Kernel_Request()
+{
+	KERNEL_CALL *call;
+
+	Dispatch();  /* select a new task to run */
+
+	while(1) {
+		// posts of an ISR that did not end with ISR_Exit(), and the work of
+		// the ISRs that interrupted the kernel
+		if (Kernel_Drain_Deferred() && Cp_Preempted()) {
+			setReady(Cp);
+			Dispatch();
+		}
+
+		/* activate this newly selected task */
+		CurrentSp = Cp->sp;
+#if TICKLESS
+		Timer_Program();  /* the next event may have changed */
+#endif
+		InKernel = 0;
+		Trace_Irq_On(__LINE__);   /* Exit_Kernel() enables interrupts in Cp */
+		call = Exit_Kernel();    /* or CSwitch() */
+
+		/* if this task makes a system call, it will return to here! */
+
+		/* save the Cp's stack pointer */
+		Cp->sp = CurrentSp;
+		Check_Stack(Cp);
+
+		// From here on ISRs find InKernel set and leave their work to the
+		// kernel, so the system call runs with interrupts enabled
+		InKernel = 1;
+		Enable_Interrupt();
+
+		/* no system call, i.e. Cp has been preempted */
+		switch(call == NULL ? NONE : call->request){
+			case CREATE:
+			//  PORTA |= (1<<PA0);
+			call->result = Kernel_Create_Task( call->args.create.f, call->args.create.arg, call->args.create.py,
+				call->args.create.period, call->args.create.wcet, call->args.create.offset,
+				call->args.create.w, call->args.create.stack_size);
+			// If we just created a system or timed task, call dispatch
+			if (call->result != 0 && call->args.create.py < RR && call->args.create.py < Cp->py){
+				//#TODO we also set ready in kernel_create_task, but I think this
+				// is correct as in create we set ready the new task, but this should
+				// set ready the task we are about to context-switch out of
+				setReady(Cp);
+				Dispatch();
+			}
+			//  PORTA &= ~(1<<PA0);
+			break;
+			case NEXT:
+			case NONE:
+			//  PORTA |= (1<<PA1);
+			/* NONE could be caused by a timer interrupt */
+			setReady(Cp);
+			Dispatch();
+			// PORTA &= ~(1<<PA1);
+			break;
+			case NEXT_TIME:
+			//  PORTA |= (1<<PA2);
+			// a SUSPENDED owner would be released on the ready queue of what it inherited
+			if (Cp->held != NULL) OS_Abort(ERROR_MUTEX_OWNER);
+			Cp->executed_ticks = 0;
+			Cp->state = SUSPENDED;
+			TimeTask = NULL;
+			Dispatch();
+			//  PORTA &= ~(1<<PA2);
+			break;
+			case TERMINATE:
+			//  PORTA |= (1<<PA4);
+			/* deallocate all resources used by this task */
+			if (Cp->held != NULL) OS_Abort(ERROR_MUTEX_OWNER);
+			if (Cp->base_py == TIME) {
+				dq_remove(&ReleaseQ, Cp);
+				if (TimeTask == Cp) TimeTask = NULL;
+			}
+			Cp->state = DEAD;
+			Stack_Free(Cp->stack, Cp->stack_size);
+			Cp->rq_next = FreePD;
+			FreePD = Cp;
+			Tasks--;
+			Dispatch();
+			// PORTA &= ~(1<<PA4);
+			break;
+			case CHAN_INIT:
+			// PORTA |= (1<<PA5);
+			call->result = Kernel_Chan_Init(call->args.chan.v);   /* v is the capacity */
+			// PORTA &= ~(1<<PA5);
+			break;
+			case CHAN_SEND:
+			// PORTA |= (1<<PA6);
+			Kernel_Chan_Send(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			// PORTA &= ~(1<<PA6);
+			break;
+			case CHAN_RECV:
+			//  PORTA |= (1<<PA7);
+			Kernel_Chan_Receive(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			// PORTA &= ~(1<<PA7);
+			break;
+			case CHAN_WRITE:
+			//  PORTA |= (1<<PA3);
+			Kernel_Chan_Write(call);
+			// PORTA &= ~(1<<PA3);
+			break;
+			case CHAN_RECV_ANY:
+			Kernel_Chan_Recv_Any(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case SLEEP:
+			Kernel_Sleep(call->args.sleep);
+			Dispatch();
+			break;
+			case POOL_WAIT:
+			// an ISR may take a block of the pool in the meantime
+			Disable_Interrupt();
+			Kernel_Pool_Wait(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case POOL_FREE:
+			// only made if the task waiting for the block preempts Cp
+			Disable_Interrupt();
+			if (Kernel_Pool_Free(Pool_Of(call->args.pool.pool), call->args.pool.block) != NULL) {
+				setReady(Cp);
+				Dispatch();
+			}
+			break;
+			case MUTEX_LOCK:
+			Kernel_Mutex_Lock(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case MUTEX_UNLOCK:
+			Kernel_Mutex_Unlock(Mutex_Of(call->args.mutex.m));
+			if (Cp_Preempted()) {
+				setReady(Cp);
+				Dispatch();
+			}
+			break;
+			case SEM_WAIT:
+			Kernel_Sem_Wait(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case EVENT_WAIT:
+			Kernel_Event_Wait(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case SEM_SIGNAL:
+			// only made if the task it wakes preempts Cp
+			Kernel_Sem_Signal(Sem_Of(call->args.sync.id));
+			if (Cp_Preempted()) {
+				setReady(Cp);
+				Dispatch();
+			}
+			break;
+			case EVENT_SET:
+			// only made if a task it wakes preempts Cp
+			Kernel_Event_Set(Event_Of(call->args.sync.id), call->args.sync.flags);
+			if (Cp_Preempted()) {
+				setReady(Cp);
+				Dispatch();
+			}
+			break;
+			case NOTIFY_WAIT:
+			Kernel_Notify_Wait(call);
+			if (Cp->state == BLOCKED) Dispatch();
+			break;
+			case NOTIFY:
+			// only made if the task it wakes preempts Cp
+			Kernel_Notify(Task_Of(call->args.sync.id), call->args.sync.flags, call->args.sync.mode);
+			if (Cp_Preempted()) {
+				setReady(Cp);
+				Dispatch();
+			}
+			break;
+			default:
+			/* Houston! we have a problem here! */
+			break;
+		}
+		Disable_Interrupt();
+	}
+}
+
+/*================
+* RTOS  API  and Stubs
+*================
+*/
+
+/**
+* This function initializes the RTOS and must be called before any other
+* system calls.
+*/
+void OS_Init()
+{
+	int x;
+
+	Tasks = 0;
+	KernelActive = 0;
+	NextP = 0;
+	Stack_Init();
+	// Process[] is zeroed at startup, i.e. every PD is DEAD, and a PD is set up
+	// when it is taken for a task. Linked backwards so that PIDs are given out in order.
+	FreePD = NULL;
+	for (x = MAXPROCESS - 1; x >= 0; x--) {
+		Process[x].rq_next = FreePD;
+		FreePD = &(Process[x]);
+	}
+
+	// Channel memory allocation
+	chanCount = 0;
+	chanBuffersUsed = 0;
+
+	Msg_Init();
+
+	PostHead = 0;
+	PostTail = 0;
+
+	poolCount = 0;
+	poolMemoryUsed = 0;
+	mutexCount = 0;
+	semCount = 0;
+	eventCount = 0;
+	tlsf_init(&Heap, HeapMemory, sizeof(HeapMemory));
+	for (x = 0; x < MAXCHAN; x++) {
+		memset(&(channels[x]),0,sizeof(CHANNEL));
+		channels[x].state = NOT_INIT;
+	}
+}
+
+
+/**
+* This function starts the RTOS after creating a few tasks.
+*/
+void OS_Start()
+{
+	if ( (! KernelActive) && (Tasks > 0)) {
+		Disable_Interrupt();
+		/* we may have to initialize the interrupt vector for Enter_Kernel() here. */
+
+		/* here we go...  */
+		KernelActive = 1;
+		Next_Kernel_Request();
+		/* NEVER RETURNS!!! */
+	}
+}
+
+/**
+* TODO: communicate error code
+*/
+void OS_Abort(unsigned int error) {
+	Debug_Abort(error);
+	for(;;){}
+}
+
+
+/*================
+* Self-served fast paths
+*================
+* A system call only has to go through Enter_Kernel() and the kernel stack if
+* it may choose a different task to run. When the stub can tell up front that
+* Cp keeps the CPU, it calls the kernel function directly on Cp's stack with
+* interrupts masked, which saves the two full context switches.
+*/
+
+/**
+* TRUE if a yield by Cp would choose Cp again, i.e. no other task is ready
+* at Cp's priority or above.
+*/
+static BOOL Cp_Keeps_CPU()
+{
+	if (count(&ReadyQSystem) > 0) return FALSE;
+	if (Cp->py == SYSTEM) return TRUE;
+	if (count(&ReadyQTime) > 0) return FALSE;
+	if (Cp->py == TIME) return TRUE;
+	return count(&ReadyQRR) == 0;
+}
+
+/**
+* TRUE if a task of priority "py" made ready by Cp would not preempt Cp.
+*/
+static BOOL Cp_Not_Preempted_By(PRIORITIES py)
+{
+	return !(py < RR && py < Cp->py);
+}
+
+/**
+* TRUE if waking up every receiver waiting on "ch" would not preempt Cp.
+*/
+static BOOL Receivers_Not_Preempting(CHAN ch)
+{
+	WAIT_NODE *n;
+
+	if (ch == 0 || ch > MAXCHAN) return FALSE;
+	for (n = channels[ch-1].receivers.head; n != NULL; n = n->next) {
+		if (n->pd->py < Cp->py) return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+* Leaves a self-served system call, restoring the caller's interrupt state.
+*/
+static void Self_Served_Exit(IRQ_STATE sreg)
+{
+#if TICKLESS
+	// we may have readied a task, which changes the next timer event
+	Timer_Program();
+#endif
+	Restore_Interrupt(sreg);
+}
+
+/**
+* The common part of the Task_Create_*() stubs. Returns the new PID, or 0.
+*/
+static PID Task_Create(voidfuncptr f, int arg, PRIORITIES py, TICK period, TICK wcet, TICK offset, WEIGHT w, unsigned int stack_size)
+{
+	if (KernelActive ) {
+		KERNEL_CALL call;
+		IRQ_STATE sreg = Save_Interrupt();
+		Disable_Interrupt();
+		if (Cp_Not_Preempted_By(py)) {
+			call.result = Kernel_Create_Task(f, arg, py, period, wcet, offset, w, stack_size);
+			Self_Served_Exit(sreg);
+			return call.result;
+		}
+		call.request = CREATE;
+		call.args.create.f = f;
+		call.args.create.arg = arg;
+		call.args.create.py = py;
+		call.args.create.period = period;
+		call.args.create.wcet = wcet;
+		call.args.create.offset = offset;
+		call.args.create.w = w;
+		call.args.create.stack_size = stack_size;
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		return call.result;
+		} else {
+		/* call the RTOS function directly, there is no Cp yet */
+		return Kernel_Create_Task(f, arg, py, period, wcet, offset, w, stack_size);
+	}
+}
+
+/**
+* For this example, we only support cooperatively multitasking, i.e.,
+* each task gives up its share of the processor voluntarily by calling
+* Task_Next().
+*/
+PID Task_Create_RR( voidfuncptr f, int arg)
+{
+	return Task_Create(f, arg, RR, 0, 0, 0, 0, WORKSPACE);
+}
+
+PID Task_Create_RR_Stack( voidfuncptr f, int arg, unsigned int stack_size)
+{
+	return Task_Create(f, arg, RR, 0, 0, 0, 0, stack_size);
+}
+
+PID Task_Create_WRR(voidfuncptr f, int arg, WEIGHT w)
+{
+	return Task_Create(f, arg, RR, 0, 0, 0, w, WORKSPACE);
+}
+
+PID Task_Create_WRR_Stack(voidfuncptr f, int arg, WEIGHT w, unsigned int stack_size)
+{
+	return Task_Create(f, arg, RR, 0, 0, 0, w, stack_size);
+}
+
+PID Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset)
+{
+	return Task_Create(f, arg, TIME, period, wcet, offset, 0, WORKSPACE);
+}
+
+PID Task_Create_Period_Stack(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset, unsigned int stack_size)
+{
+	return Task_Create(f, arg, TIME, period, wcet, offset, 0, stack_size);
+}
+
+PID Task_Create_System(voidfuncptr f, int arg)
+{
+	return Task_Create(f, arg, SYSTEM, 0, 0, 0, 0, WORKSPACE);
+}
+
+PID Task_Create_System_Stack(voidfuncptr f, int arg, unsigned int stack_size)
+{
+	return Task_Create(f, arg, SYSTEM, 0, 0, 0, 0, stack_size);
+}
+
+/**
+* The idle task only ever sleeps, so it gets the smallest stack possible.
+*/
+PID Task_Create_Idle( voidfuncptr f, int arg)
+{
+	return Task_Create(f, arg, IDLE_TASK, 0, 0, 0, 0, PORT_MIN_STACK);
+}
+
+/**
+* The calling task gives up its share of the processor voluntarily.
+*/
+/**
+* Counts one quantum for Cp, and returns TRUE if Cp has to give up the
+* processor. Must be called with interrupts disabled.
+*/
+static BOOL Cp_Quantum_Expired()
+{
+	if(Cp->py == RR) {
+		// increment executed ticks for RR
+		Cp->executed_ticks = Cp->executed_ticks + 1;
+		// Keep running if less ticks than weight
+		if (Cp->executed_ticks < Cp->w) {
+			return FALSE;
+		}
+	}
+	Cp->executed_ticks = 0;
+	// Nobody to yield to, keep running
+	return !Cp_Keeps_CPU();
+}
+
+void Task_Next_2()
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		IRQ_STATE sreg = Save_Interrupt();
+		Disable_Interrupt();
+		if (!Cp_Quantum_Expired()) {
+			Restore_Interrupt(sreg);
+			return;
+		}
+		call.request = NEXT;
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+	}
+}
+
+/**
+* Forces the running task back onto its ready queue, without touching its
+* execution counters. Used when an interrupt readies a higher priority task.
+*/
+static void Task_Preempt()
+{
+	Disable_Interrupt();
+	Trace_Irq_Off(__LINE__);   /* called from an ISR, so interrupts were off already */
+	Debug_Kernel_Entry();
+	Enter_Kernel(NULL);
+}
+
+void Task_Next()
+{
+	if (KernelActive) {
+		if(Cp->base_py != TIME){
+			Task_Next_2();
+			}else{
+			// Here we handle the edge case of a Time based task giving up the
+			// processor voluntarily. It should suspend itself
+			KERNEL_CALL call;
+			call.request = NEXT_TIME;
+			Disable_Interrupt();
+			Debug_Kernel_Entry();
+			Enter_Kernel_Voluntary(&call);
+		}
+	}
+}
+
+/**
+* The calling System or RR task sleeps for "t" ticks without using the CPU.
+*/
+void Task_Sleep(TICK t)
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		call.request = SLEEP;
+		call.args.sleep = t;
+		Disable_Interrupt();
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+	}
+}
+
+/**
+* The calling System or RR task sleeps until Now() reaches "t" milliseconds,
+* rounded up to the next tick. It returns at once if "t" has already passed.
+*/
+void Task_SleepUntil(unsigned int t)
+{
+	IRQ_STATE sreg;
+	unsigned int tick_start;
+	unsigned int remaining = t - Now();
+
+	// wrap-around safe version of t <= Now()
+	if (remaining == 0 || remaining >= 0x8000) return;
+	// Kernel_Sleep() counts from the start of the current tick, not from Now()
+	sreg = Save_Interrupt();
+	Disable_Interrupt();
+	tick_start = MSECPERTICK * (current_tick + Timer_Passed());
+	Restore_Interrupt(sreg);
+	Task_Sleep((t - tick_start + MSECPERTICK - 1) / MSECPERTICK);
+}
+
+/**
+* The calling task gets its initial "argument" when it was created.
+*/
+int  Task_GetArg(void)
+{
+	return Cp->arg;
+}
+
+PID  Task_GetPid(void)
+{
+	return Cp->pid;
+}
+
+#if STACK_WATERMARK
+/**
+* Returns the number of bytes at the end of the stack of task "p" that have never
+* been used, i.e. are still painted. Returns 0 if "p" is not a live task.
+*/
+unsigned int Task_StackUnused(PID p)
+{
+	unsigned int n = 0;
+	volatile PD* pd;
+
+	if (p == 0 || p > MAXPROCESS) return 0;
+	pd = &(Process[p-1]);
+	if (pd->state == DEAD) return 0;
+	while (n < pd->stack_size && pd->stack[n] == STACK_PAINT) {
+		n++;
+	}
+	return n;
+}
+#endif
+
+
+/**
+* The calling task terminates itself.
+*/
+void Task_Terminate()
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		call.request = TERMINATE;
+		Disable_Interrupt();
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		/* never returns here! */
+	}
+}
+
+/**
+* Requests channel through kernel
+* A value of zero/NULL means a channel could not be created
+*/
+CHAN Chan_Init()
+{
+	return Chan_Init_Buffered(0);
+}
+
+/**
+* Requests a channel with a buffer of "capacity" values
+* A value of zero/NULL means a channel could not be created
+*/
+CHAN Chan_Init_Buffered(unsigned int capacity)
+{
+	if (KernelActive) {
+		// Never reschedules, always self-served
+		IRQ_STATE sreg = Save_Interrupt();
+		CHAN ch;
+		Disable_Interrupt();
+		ch = Kernel_Chan_Init(capacity);
+		Restore_Interrupt(sreg);
+		return ch;
+	}
+	return 0;
+}
+
+static BOOL Chan_Send( CHAN ch, int v, BOOL msg, TICK t );
+static void Chan_Write( CHAN ch, int v, BOOL msg );
+
+/**
+* blocking send on CHAN
+*/
+void Send( CHAN ch, int v )
+{
+	Chan_Send(ch, v, FALSE, WAIT_FOREVER);
+}
+
+/**
+* Send() that gives up after "t" ticks, returns FALSE if it did
+*/
+BOOL Send_Timeout( CHAN ch, int v, TICK t )
+{
+	return Chan_Send(ch, v, FALSE, t);
+}
+
+/**
+* Send() of a value or a message
+*/
+static BOOL Chan_Send( CHAN ch, int v, BOOL msg, TICK t )
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		IRQ_STATE sreg = Save_Interrupt();
+		BOOL ready;
+		call.request = CHAN_SEND;
+		call.args.chan.ch = ch;
+		call.args.chan.v = v;
+		call.args.chan.msg = msg;
+		call.args.chan.timeout = t;
+		call.args.chan.timed_out = FALSE;
+		Disable_Interrupt();
+		// Receivers are waiting, or there is room in the buffer
+		ready = ch > 0 && ch <= MAXCHAN
+			&& (channels[ch-1].state == RECEIVER_WAIT || channels[ch-1].used < channels[ch-1].capacity);
+		// ... and no receiver preempts us
+		if (ready && (Cp->base_py != TIME || t == 0) && Receivers_Not_Preempting(ch)) {
+			Kernel_Chan_Send(&call);
+			Self_Served_Exit(sreg);
+			return TRUE;
+		}
+		// A try that fails never enters the kernel
+		if (!ready && t == 0 && ch > 0 && ch <= MAXCHAN && channels[ch-1].state != NOT_INIT) {
+			Restore_Interrupt(sreg);
+			return FALSE;
+		}
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		return !call.args.chan.timed_out;
+	}
+	return FALSE;
+}
+
+/**
+* blocking receive on CHAN
+*/
+int Recv( CHAN ch )
+{
+	int v;
+	if (Recv_Timeout(ch, &v, WAIT_FOREVER)) return v;
+	return (-1);
+}
+
+/**
+* Recv() that gives up after "t" ticks, returns FALSE if it did
+*/
+BOOL Recv_Timeout( CHAN ch, int *v, TICK t )
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		WAIT_NODE node;
+		IRQ_STATE sreg = Save_Interrupt();
+		BOOL ready;
+		call.request = CHAN_RECV;
+		call.args.chan.ch = ch;
+		call.args.chan.nodes = &node;
+		call.args.chan.timeout = t;
+		call.args.chan.timed_out = FALSE;
+		Disable_Interrupt();
+		// A value is buffered or a sender is waiting
+		ready = ch > 0 && ch <= MAXCHAN
+			&& (channels[ch-1].used > 0 || channels[ch-1].state == SENDER_WAIT);
+		// ... and no sender we resume preempts us
+		if (ready && (Cp->base_py != TIME || t == 0)
+			&& (channels[ch-1].state != SENDER_WAIT || Cp_Not_Preempted_By(channels[ch-1].sender->py))) {
+			Kernel_Chan_Receive(&call);
+			Self_Served_Exit(sreg);
+			*v = call.result;
+			return TRUE;
+		}
+		// A try that fails never enters the kernel
+		if (!ready && t == 0 && ch > 0 && ch <= MAXCHAN && channels[ch-1].state != NOT_INIT) {
+			Restore_Interrupt(sreg);
+			return FALSE;
+		}
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		if (call.args.chan.timed_out) return FALSE;
+		*v = call.result;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+* blocking receive on any of the "n" CHANs in "chs"
+*/
+int Recv_Any(const CHAN *chs, unsigned int n, CHAN *ch)
+{
+	// the nodes are on our stack, a large set would overflow it unchecked
+	if (n > MAXRECVANY) OS_Abort(ERROR_RECV_ANY_SET);
+	if (KernelActive && n > 0) {
+		KERNEL_CALL call;
+		WAIT_NODE nodes[MAXRECVANY];   /* on our stack while we wait */
+		IRQ_STATE sreg = Save_Interrupt();
+		unsigned int i;
+		call.request = CHAN_RECV_ANY;
+		call.args.chan.set = chs;
+		call.args.chan.n = n;
+		call.args.chan.nodes = nodes;
+		call.args.chan.timeout = WAIT_FOREVER;
+		Disable_Interrupt();
+		// Same as Recv(), on the first channel that has a value or a waiting sender
+		for (i = 0; i < n && Cp->base_py != TIME && chs[i] > 0 && chs[i] <= MAXCHAN; i++) {
+			CHANNEL *chan = &(channels[chs[i]-1]);
+			if (chan->used == 0 && chan->state != SENDER_WAIT) continue;
+			if (chan->state != SENDER_WAIT || Cp_Not_Preempted_By(chan->sender->py)) {
+				call.args.chan.ch = chs[i];
+				Kernel_Chan_Receive(&call);
+				Self_Served_Exit(sreg);
+				if (ch != NULL) *ch = call.args.chan.ch;
+				return call.result;
+			}
+			break;
+		}
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		if (ch != NULL) *ch = call.args.chan.ch;
+		return call.result;
+	}
+	return (-1);
+}
+
+/**
+* non-blocking send on CHAN
+*/
+void Write( CHAN ch, int v )
+{
+	Chan_Write(ch, v, FALSE);
+}
+
+/**
+* Write() of a value or a message
+*/
+static void Chan_Write( CHAN ch, int v, BOOL msg )
+{
+	if (KernelActive) {
+		KERNEL_CALL call;
+		IRQ_STATE sreg = Save_Interrupt();
+		call.request = CHAN_WRITE;
+		call.args.chan.ch = ch;
+		call.args.chan.v = v;
+		call.args.chan.msg = msg;
+		Disable_Interrupt();
+		// No receivers, or none of them preempts us
+		if (Receivers_Not_Preempting(ch)) {
+			Kernel_Chan_Write(&call);
+			Self_Served_Exit(sreg);
+			return;
+		}
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+	}
+}
+
+/**
+* Takes a free message from the message pool, or returns NULL if there is none.
+* Never reschedules, always self-served.
+*/
+void *Msg_Alloc()
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	MSG_BUF *m;
+	Disable_Interrupt();
+	m = FreeMsgs;
+	if (m != NULL) {
+		FreeMsgs = m->next;
+		MsgRefs[m - MsgPool] = 1;
+	}
+	Restore_Interrupt(sreg);
+	return m;
+}
+
+/**
+* The calling task is done with "msg". The message goes back to the pool once
+* every receiver of it is done.
+*/
+void Msg_Free(void *msg)
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	Msg_Release(Msg_Value(msg));
+	Restore_Interrupt(sreg);
+}
+
+/**
+* Send(), Write() and Recv() of a message. Only the message's pool index goes
+* through the CHAN, so a message is never copied.
+*/
+void Msg_Send(CHAN ch, void *msg)
+{
+	Chan_Send(ch, Msg_Value(msg), TRUE, WAIT_FOREVER);
+}
+
+void Msg_Write(CHAN ch, void *msg)
+{
+	Chan_Write(ch, Msg_Value(msg), TRUE);
+}
+
+void *Msg_Recv(CHAN ch)
+{
+	int v = Recv(ch);
+	if (v <= 0 || v > MSG_COUNT) return NULL;
+	return &(MsgPool[v-1]);
+}
+
+/**
+* Creates a pool of "count" blocks of "block_size" bytes.
+* A value of zero/NULL means there is no pool or memory left for it.
+*/
+POOL Pool_Create(unsigned int block_size, unsigned int count)
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	POOL p;
+	Disable_Interrupt();
+	p = Kernel_Pool_Create(block_size, count);
+	Restore_Interrupt(sreg);
+	return p;
+}
+
+/**
+* Takes a block from "p", or returns NULL at once if there is none. Never
+* reschedules, so it may be called from an ISR.
+*/
+void *Pool_Alloc(POOL p)
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	void *block;
+	Disable_Interrupt();
+	block = Kernel_Pool_Alloc(Pool_Of(p));
+	Restore_Interrupt(sreg);
+	return block;
+}
+
+/**
+* Takes a block from "p", and blocks until one is freed if there is none.
+* Called with interrupts disabled, e.g. from an ISR, it cannot block and is the
+* same as Pool_Alloc().
+*/
+void *Pool_Alloc_Wait(POOL p)
+{
+	KERNEL_CALL call;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	call.args.pool.block = Kernel_Pool_Alloc(Pool_Of(p));
+	if (call.args.pool.block != NULL || !KernelActive || !Interrupts_Enabled(sreg)) {
+		Restore_Interrupt(sreg);
+		return call.args.pool.block;
 	}
+	call.request = POOL_WAIT;
+	call.args.pool.pool = p;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+	return call.args.pool.block;
 }
 
-/*================
-* RTOS  API  and Stubs
-*================
+/**
+* Gives "block" back to "p". If a task is waiting for a block, it gets this one.
+* When called from an ISR, that task runs once the ISR calls ISR_Exit().
 */
+void Pool_Free(POOL p, void *block)
+{
+	MEMPOOL *pool;
+	KERNEL_CALL call;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	pool = Pool_Of(p);
+	// an ISR has interrupted the kernel, which is the only one to touch the ready queues then
+	if (InKernel && count(&(pool->waiters)) > 0) {
+		POST *post = Post_Next();
+		if (post == NULL) OS_Abort(ERROR_ISR_POSTS_FULL);
+		post->request = POOL_FREE;
+		post->target = p;
+		post->arg.block = block;
+		Post_Commit();
+		Restore_Interrupt(sreg);
+		return;
+	}
+	// the waiter would preempt us, let the kernel switch to it
+	if (KernelActive && Interrupts_Enabled(sreg) && count(&(pool->waiters)) > 0
+		&& !Cp_Not_Preempted_By(pool->waiters.head->py)) {
+		call.request = POOL_FREE;
+		call.args.pool.pool = p;
+		call.args.pool.block = block;
+		Debug_Kernel_Entry();
+		Enter_Kernel_Voluntary(&call);
+		return;
+	}
+	Kernel_Pool_Free(pool, block);
+	if (KernelActive && !InKernel) {
+		Self_Served_Exit(sreg);
+	} else {
+		Restore_Interrupt(sreg);
+	}
+}
 
 /**
-* This function initializes the RTOS and must be called before any other
-* system calls.
+* Copies the counters of "p" into "stats".
 */
-void OS_Init()
+void Pool_GetStats(POOL p, POOL_STATS *stats)
 {
-	int x;
+	IRQ_STATE sreg = Save_Interrupt();
+	MEMPOOL *pool;
+	Disable_Interrupt();
+	pool = Pool_Of(p);
+	stats->block_size = pool->block_size;
+	stats->count = pool->count;
+	stats->used = pool->used;
+	stats->high_water = pool->high_water;
+	stats->failures = pool->failures;
+	Restore_Interrupt(sreg);
+}
 
-	Tasks = 0;
-	KernelActive = 0;
-	NextP = 0;
-	//Reminder: Clear the memory for the task on creation.
-	for (x = 0; x < MAXPROCESS; x++) {
-		memset(&(Process[x]),0,sizeof(PD));
-		Process[x].state = DEAD;
-	}
+/**
+* Creates a mutex, or returns 0 if there are MAXMUTEX of them already.
+*/
+MUTEX Mutex_Init()
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	MUTEX m;
+	Disable_Interrupt();
+	m = Kernel_Mutex_Init();
+	Restore_Interrupt(sreg);
+	return m;
+}
 
-	// Channel memory allocation
-	chanCount = 0;
-	for (x = 0; x < MAXCHAN; x++) {
-		memset(&(channels[x]),0,sizeof(CHANNEL));
-		channels[x].state = NOT_INIT;
+/**
+* Takes a free mutex right here; the kernel is only entered to wait for it.
+*/
+void Mutex_Lock(MUTEX m)
+{
+	KERNEL_CALL call;
+	WAIT_NODE node;
+	KERNEL_MUTEX *mutex;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	mutex = Mutex_Of(m);
+	if (mutex->owner == NULL) {
+		Mutex_Take(mutex, Cp);
+		Restore_Interrupt(sreg);
+		return;
 	}
+	if (mutex->owner == Cp) OS_Abort(ERROR_MUTEX_OWNER);
+	call.request = MUTEX_LOCK;
+	call.args.mutex.m = m;
+	call.args.mutex.node = &node;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
 }
 
+/**
+* Frees a mutex nobody waits for right here; otherwise the kernel hands it over
+* to the first waiter, which may preempt the caller.
+*/
+void Mutex_Unlock(MUTEX m)
+{
+	KERNEL_CALL call;
+	KERNEL_MUTEX *mutex;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	mutex = Mutex_Of(m);
+	if (mutex->owner != Cp) OS_Abort(ERROR_MUTEX_OWNER);
+	// without waiters, the mutex has not raised Cp's priority either
+	if (mutex->waiters.count == 0) {
+		Mutex_Give(mutex);
+		Restore_Interrupt(sreg);
+		return;
+	}
+	call.request = MUTEX_UNLOCK;
+	call.args.mutex.m = m;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+}
 
 /**
-* This function starts the RTOS after creating a few tasks.
+* Creates a semaphore with "count", or returns 0 if there are MAXSEM of them already.
 */
-void OS_Start()
+SEM Sem_Init(unsigned int count)
 {
-	if ( (! KernelActive) && (Tasks > 0)) {
-		Disable_Interrupt();
-		/* we may have to initialize the interrupt vector for Enter_Kernel() here. */
+	IRQ_STATE sreg = Save_Interrupt();
+	SEM s;
+	Disable_Interrupt();
+	s = Kernel_Sem_Init(count);
+	Restore_Interrupt(sreg);
+	return s;
+}
 
-		/* here we go...  */
-		KernelActive = 1;
-		Next_Kernel_Request();
-		/* NEVER RETURNS!!! */
+/**
+* Counts the signal or wakes a waiter right here, unless the waiter preempts us.
+*/
+void Sem_Signal(SEM s)
+{
+	KERNEL_CALL call;
+	KERNEL_SEM *sem;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	sem = Sem_Of(s);
+	if (sem->waiters.count == 0) {
+		sem->count++;
+		Restore_Interrupt(sreg);
+		return;
+	}
+	if (Cp_Not_Preempted_By(sem->waiters.head->pd->py)) {
+		Kernel_Sem_Signal(sem);
+		Self_Served_Exit(sreg);
+		return;
 	}
+	call.request = SEM_SIGNAL;
+	call.args.sync.id = s;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+}
+
+void Sem_Wait(SEM s)
+{
+	Sem_Wait_Timeout(s, WAIT_FOREVER);
 }
 
 /**
-* TODO: communicate error code
+* Takes one from the count right here; the kernel is only entered to wait.
 */
-void OS_Abort(unsigned int error) {
-	OS_ABORT_DEBUG_PORT = error;
-	for(;;){}
+BOOL Sem_Wait_Timeout(SEM s, TICK t)
+{
+	KERNEL_CALL call;
+	WAIT_NODE node;
+	KERNEL_SEM *sem;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	sem = Sem_Of(s);
+	if (sem->count > 0) {
+		sem->count--;
+		Restore_Interrupt(sreg);
+		return TRUE;
+	}
+	// A try that fails never enters the kernel
+	if (t == 0) {
+		Restore_Interrupt(sreg);
+		return FALSE;
+	}
+	call.request = SEM_WAIT;
+	call.args.sync.id = s;
+	call.args.sync.node = &node;
+	call.args.sync.timeout = t;
+	call.args.sync.timed_out = FALSE;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+	return !call.args.sync.timed_out;
 }
 
+/**
+* Creates a group of event flags, or returns 0 if there are MAXEVENT of them already.
+*/
+EVENT Event_Init()
+{
+	IRQ_STATE sreg = Save_Interrupt();
+	EVENT e;
+	Disable_Interrupt();
+	e = Kernel_Event_Init();
+	Restore_Interrupt(sreg);
+	return e;
+}
 
 /**
-* For this example, we only support cooperatively multitasking, i.e.,
-* each task gives up its share of the processor voluntarily by calling
-* Task_Next().
+* TRUE if setting "flags" of "event" would wake a task that preempts Cp.
 */
-PID Task_Create_RR( voidfuncptr f, int arg)
+static BOOL Event_Wakes_Preempting(KERNEL_EVENT *event, unsigned int flags)
 {
-	if (KernelActive ) {
-		Disable_Interrupt();
-		Cp ->request = CREATE;
-		Cp->code = f;
-		Cp->arg = arg;
-		Cp->py_arg = RR;
-		Cp->period_arg = 0;
-		Cp->wcet_arg = 0;
-		Cp->offset_arg = 0;
-		Cp->w = 0;
-		
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		} else {
-		/* call the RTOS function directly */
-		Kernel_Create_Task( f, arg, RR, 0, 0, 0, 0);
+	WAIT_NODE *n;
+
+	for (n = event->waiters.head; n != NULL; n = n->next) {
+		if (!Cp_Not_Preempted_By(n->pd->py) && Event_Match(n->pd->call, event->flags | flags) != 0) {
+			return TRUE;
+		}
 	}
-	return Tasks;
+	return FALSE;
 }
 
-PID Task_Create_WRR(voidfuncptr f, int arg, WEIGHT w)
+/**
+* Sets the flags and wakes the waiters right here, unless one of them preempts us.
+*/
+void Event_Set(EVENT e, unsigned int flags)
 {
-	if (KernelActive ) {
-		Disable_Interrupt();
-		Cp->request = CREATE;
-		Cp->code = f;
-		Cp->arg = arg;
-		Cp->py_arg = RR;
-		Cp->period_arg = 0;
-		Cp->wcet_arg = 0;
-		Cp->offset_arg = 0;
-		Cp->w = w;
-		
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		} else {
-		/* call the RTOS function directly */
-		Kernel_Create_Task(f, arg, RR, 0, 0, 0, w);
+	KERNEL_CALL call;
+	KERNEL_EVENT *event;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	event = Event_Of(e);
+	if (event->waiters.count == 0) {
+		event->flags |= flags;
+		Restore_Interrupt(sreg);
+		return;
 	}
-	return Tasks;
+	if (!Event_Wakes_Preempting(event, flags)) {
+		Kernel_Event_Set(event, flags);
+		Self_Served_Exit(sreg);
+		return;
+	}
+	call.request = EVENT_SET;
+	call.args.sync.id = e;
+	call.args.sync.flags = flags;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
 }
 
-PID Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset)
+/**
+* Clearing flags never wakes anybody, always self-served.
+*/
+unsigned int Event_Clear(EVENT e, unsigned int flags)
 {
-	if (KernelActive ) {
-		Disable_Interrupt();
-		Cp ->request = CREATE;
-		Cp->code = f;
-		Cp->arg = arg;
-		Cp->py_arg = TIME;
-
-		Cp->period_arg = period;
-		Cp->wcet_arg = wcet;
-		Cp->offset_arg = offset;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		} else {
-		/* call the RTOS function directly */
-		Kernel_Create_Task( f, arg, TIME, period, wcet, offset, 0);
+	IRQ_STATE sreg = Save_Interrupt();
+	KERNEL_EVENT *event;
+	unsigned int old;
+	Disable_Interrupt();
+	event = Event_Of(e);
+	old = event->flags;
+	event->flags &= ~flags;
+	Restore_Interrupt(sreg);
+	return old;
+}
+
+unsigned int Event_Wait(EVENT e, unsigned int flags, unsigned int mode)
+{
+	return Event_Wait_Timeout(e, flags, mode, WAIT_FOREVER);
+}
+
+/**
+* Returns right here if the flags are set already; the kernel is only entered to wait.
+*/
+unsigned int Event_Wait_Timeout(EVENT e, unsigned int flags, unsigned int mode, TICK t)
+{
+	KERNEL_CALL call;
+	WAIT_NODE node;
+	KERNEL_EVENT *event;
+	unsigned int set;
+	IRQ_STATE sreg = Save_Interrupt();
+	if (flags == 0) return 0;
+	call.args.sync.flags = flags;
+	call.args.sync.mode = mode;
+	Disable_Interrupt();
+	event = Event_Of(e);
+	set = Event_Match(&call, event->flags);
+	if (set != 0) {
+		if (mode & EVENT_CLEAR) event->flags &= ~set;
+		Restore_Interrupt(sreg);
+		return set;
 	}
-	return Cp->pid;
+	// A try that fails never enters the kernel
+	if (t == 0) {
+		Restore_Interrupt(sreg);
+		return 0;
+	}
+	call.request = EVENT_WAIT;
+	call.args.sync.id = e;
+	call.args.sync.node = &node;
+	call.args.sync.timeout = t;
+	call.args.sync.timed_out = FALSE;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+	if (call.args.sync.timed_out) return 0;
+	return call.result;
 }
 
-PID Task_Create_System(voidfuncptr f, int arg)
+/**
+* Notifies right here, unless the task it wakes preempts us. Returns FALSE if
+* there is no task "p".
+*/
+BOOL Task_Notify(PID p, unsigned int v, unsigned int action)
 {
-	if (KernelActive ) {
-		Disable_Interrupt();
-		Cp ->request = CREATE;
-		Cp->code = f;
-		Cp->arg = arg;
-		Cp->py_arg = SYSTEM;
-		Cp->period_arg = 0;
-		Cp->wcet_arg = 0;
-		Cp->offset_arg = 0;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
+	KERNEL_CALL call;
+	volatile PD *pd;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	pd = Task_Of(p);
+	if (pd == NULL) {
+		Restore_Interrupt(sreg);
+		return FALSE;
+	}
+	// "p" is not waiting for it, or does not preempt us
+	if (pd->state != BLOCKED || pd->call == NULL || pd->call->request != NOTIFY_WAIT
+		|| Cp_Not_Preempted_By(pd->py)) {
+		if (Kernel_Notify(pd, v, action) != NULL) {
+			Self_Served_Exit(sreg);
 		} else {
-		/* call the RTOS function directly */
-		Kernel_Create_Task( f, arg, SYSTEM, 0, 0, 0, 0);
+			Restore_Interrupt(sreg);
+		}
+		return TRUE;
 	}
-	return Cp->pid;
+	call.request = NOTIFY;
+	call.args.sync.id = p;
+	call.args.sync.flags = v;
+	call.args.sync.mode = action;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+	return TRUE;
 }
 
-PID Task_Create_Idle( voidfuncptr f, int arg)
+/**
+* Takes a pending notification right here; the kernel is only entered to wait.
+*/
+BOOL Task_Notify_Wait(unsigned int clear, unsigned int *v, TICK t)
 {
-	if (KernelActive ) {
-		Disable_Interrupt();
-		Cp ->request = CREATE;
-		Cp->code = f;
-		Cp->arg = arg;
-		Cp->py = IDLE_TASK;
-		Cp->period = 0;
-		Cp->wcet = 0;
-		Cp->offset = 0;
-
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		} else {
-		/* call the RTOS function directly */
-		Kernel_Create_Task( f, arg, IDLE_TASK, 0, 0, 0, 0);
+	KERNEL_CALL call;
+	IRQ_STATE sreg = Save_Interrupt();
+	call.args.sync.flags = clear;
+	Disable_Interrupt();
+	if (Notify_Take(&call)) {
+		Restore_Interrupt(sreg);
+		if (v != NULL) *v = call.result;
+		return TRUE;
 	}
-	return Cp->pid;
+	// A try that fails never enters the kernel
+	if (t == 0) {
+		Restore_Interrupt(sreg);
+		return FALSE;
+	}
+	call.request = NOTIFY_WAIT;
+	call.args.sync.timeout = t;
+	call.args.sync.timed_out = FALSE;
+	Debug_Kernel_Entry();
+	Enter_Kernel_Voluntary(&call);
+	if (call.args.sync.timed_out) return FALSE;
+	sreg = Save_Interrupt();
+	Disable_Interrupt();
+	Notify_Take(&call);
+	Restore_Interrupt(sreg);
+	if (v != NULL) *v = call.result;
+	return TRUE;
 }
 
 /**
-* The calling task gives up its share of the processor voluntarily.
+* The block is tagged with the PID of the running task, so that Mem_Free() knows whom
+* to give the bytes back to whichever task frees it.
 */
-void Task_Next_2()
+void *Mem_Alloc(unsigned int size)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		if(Cp->py == RR) {
-			// increment executed ticks for RR
-			Cp->executed_ticks = Cp->executed_ticks + 1;
-			// Keep running if less ticks than weight
-			if (Cp->executed_ticks < Cp->w) {
-				return;	
-			}
-		}
-		Cp->executed_ticks = 0;
-		Cp->request = NEXT;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
+	void *p;
+	PID pid;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	pid = (KernelActive && Cp != NULL) ? Cp->pid : 0;
+	p = tlsf_malloc(&Heap, size, pid);
+	if (p != NULL && pid != 0) {
+		Process[pid-1].heap_used += tlsf_size(p);
 	}
+	Restore_Interrupt(sreg);
+	return p;
 }
 
-void Task_Next()
+void Mem_Free(void *p)
 {
-	if (KernelActive) {
-		if(Cp->py != TIME){
-			Task_Next_2();
-			}else{
-			// Here we handle the edge case of a Time based task giving up the
-			// processor voluntarily. It should suspend itself
-			Disable_Interrupt();
-			Cp ->request = NEXT_TIME;
-			PORTL = (1<<KERNEL_DEBUG_PIN);
-			Enter_Kernel();
-		}
+	PID pid;
+	IRQ_STATE sreg;
+
+	if (p == NULL) return;
+	sreg = Save_Interrupt();
+	Disable_Interrupt();
+	pid = tlsf_tag(p);
+	if (pid != 0) {
+		Process[pid-1].heap_used -= tlsf_size(p);
 	}
+	tlsf_free(&Heap, p);
+	Restore_Interrupt(sreg);
+}
+
+unsigned int Task_HeapUsed(PID p)
+{
+	if (p == 0 || p > MAXPROCESS) return 0;
+	return Process[p-1].heap_used;
 }
 
 /**
-* The calling task gets its initial "argument" when it was created.
+* Not for real-time use, see os.h: interrupts stay disabled for the whole walk,
+* so that no Mem_Alloc() or Mem_Free() from an ISR can merge the block it is at.
 */
-int  Task_GetArg(void)
+void Mem_GetStats(MEM_STATS *stats)
 {
-	return Cp->arg;
+	TLSF_STATS s;
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	tlsf_stats(&Heap, &s);
+	Restore_Interrupt(sreg);
+	stats->free = s.free;
+	stats->used = s.used;
+	stats->largest_free = s.largest_free;
+	stats->free_blocks = s.free_blocks;
+	stats->used_blocks = s.used_blocks;
+}
+
+#if IRQ_TRACE
+static unsigned int IrqOffStart;   /* Trace_Clock() when the open window began */
+static unsigned int IrqOffLine;    /* where it began, 0 if there is none */
+static IRQ_STATS IrqMax;
+
+static void Trace_Irq_Off(unsigned int line)
+{
+	if (IrqOffLine != 0) return;
+	IrqOffLine = line;
+	IrqOffStart = Trace_Clock();
 }
 
+static void Trace_Irq_On(unsigned int line)
+{
+	unsigned int us;
+
+	// interrupts disabled by the hardware, i.e. in an ISR, are not traced
+	if (IrqOffLine == 0) return;
+	us = (unsigned int)(Trace_Clock() - IrqOffStart) / TRACE_COUNTS_PER_US;
+	if (us > IrqMax.max_us) {
+		IrqMax.max_us = us;
+		IrqMax.file = __FILE__;
+		IrqMax.line = IrqOffLine;
+		IrqMax.end_line = line;
+	}
+	IrqOffLine = 0;
+}
+#endif
 
 /**
-* The calling task terminates itself.
+* The longest interrupts-off window so far, all 0 unless IRQ_TRACE is set.
 */
-void Task_Terminate()
+void Irq_GetStats(IRQ_STATS *stats)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		Cp -> request = TERMINATE;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		/* never returns here! */
-	}
+#if IRQ_TRACE
+	IRQ_STATE sreg = Save_Interrupt();
+	Disable_Interrupt();
+	*stats = IrqMax;
+	Restore_Interrupt(sreg);
+#else
+	stats->max_us = 0;
+	stats->file = NULL;
+	stats->line = 0;
+	stats->end_line = 0;
+#endif
 }
 
 /**
-* Requests channel through kernel
-* A value of zero/NULL means a channel could not be created
+* Posts a Write() from an ISR, see Kernel_Post_Write(). Returns FALSE if there
+* is no room left for it. Must be called with interrupts disabled, as in an ISR.
 */
-CHAN Chan_Init()
+BOOL Write_FromISR(CHAN ch, int v)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		Cp ->request = CHAN_INIT;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		return Cp->kernel_response;
-	}
-	return NULL;
+	POST *post = Post_Next();
+
+	if (post == NULL) return FALSE;
+	post->request = CHAN_WRITE;
+	post->target = ch;
+	post->arg.v = v;
+	Post_Commit();
+	return TRUE;
 }
 
 /**
-* blocking send on CHAN
+* Posts a Sem_Signal() from an ISR, like Write_FromISR().
 */
-void Send( CHAN ch, int v )
+BOOL Sem_Signal_FromISR(SEM s)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		Cp->request = CHAN_SEND;
-		Cp->comm_chan = ch;
-		Cp->kernel_chan_arg = v;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-	}
+	POST *post = Post_Next();
+
+	if (post == NULL) return FALSE;
+	post->request = SEM_SIGNAL;
+	post->target = s;
+	Post_Commit();
+	return TRUE;
 }
 
 /**
-* blocking receive on CHAN
+* Posts an Event_Set() from an ISR, like Write_FromISR().
 */
-int Recv( CHAN ch )
+BOOL Event_Set_FromISR(EVENT e, unsigned int flags)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		Cp->request = CHAN_RECV;
-		Cp->comm_chan = ch;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-		return Cp->kernel_response;
-	}
-	return (-1);
+	POST *post = Post_Next();
+
+	if (post == NULL) return FALSE;
+	post->request = EVENT_SET;
+	post->target = e;
+	post->arg.v = flags;
+	Post_Commit();
+	return TRUE;
 }
 
 /**
-* non-blocking send on CHAN
+* Posts a Task_Notify() from an ISR, like Write_FromISR().
 */
-void Write( CHAN ch, int v )
+BOOL Task_Notify_FromISR(PID p, unsigned int v, unsigned int action)
 {
-	if (KernelActive) {
-		Disable_Interrupt();
-		Cp ->request = CHAN_WRITE;
-		Cp->comm_chan = ch;
-		Cp->kernel_chan_arg = v;
-		PORTL = (1<<KERNEL_DEBUG_PIN);
-		Enter_Kernel();
-	}
+	POST *post = Post_Next();
+
+	if (post == NULL) return FALSE;
+	post->request = NOTIFY;
+	post->target = p;
+	post->arg.v = v;
+	post->action = action;
+	Post_Commit();
+	return TRUE;
 }
 
 /**
 * Returns number of milliseconds since RTOS boot
-* Each tick is 10 ms, and Timer3 resets every tick
-* From this, Current time = (10 * current_tick) + (Timer3 / 2000)
-* Note 2000 timer ticks = 1ms, with prescale 1/8
+* Timer3 restarts at the end of every compare window, which spans one or more ticks.
+* From this, Current time = (MSECPERTICK * current_tick) + (Timer3 / TIMER_COUNTS_PER_MS)
+* If the window has just ended but its interrupt is still pending (e.g. we are called
+* from the kernel), the window is added here so that time never runs backwards.
 */
 unsigned int Now()
 {
-	unsigned int temp_time = TCNT3;
-	unsigned int time = (10 * current_tick) + (temp_time / 2000);
-	return time;
+	IRQ_STATE sreg = Save_Interrupt();
+	TICK ticks;
+	unsigned int temp_time;
+
+	Disable_Interrupt();
+	ticks = current_tick + DeferredTicks;
+	temp_time = Timer_Count();
+	if (Timer_Window_Ended()) {
+		ticks += timer_window;
+		temp_time = Timer_Count();
+	}
+	Restore_Interrupt(sreg);
+	return (MSECPERTICK * ticks) + (temp_time / TIMER_COUNTS_PER_MS);
 }
 
 
@@ -952,93 +3500,221 @@ unsigned int Now()
 void Timer_Init()
 {
 	Disable_Interrupt();
-	//Clear timer config.
-	TCCR3A = 0;
-	TCCR3B = 0;
-	//Set to CTC (mode 4)
-	TCCR3B |= (1<<WGM32);
+	// a first window of one tick
+	Port_Timer_Init(TIMER_COUNTS_PER_TICK);
+	timer_window = 1;
+#if IRQ_TRACE
+	Port_Trace_Init();
+#endif
+
+	// enable interrupt
+	Enable_Interrupt();
+}
 
-	//Set prescaller to 1/8
-	TCCR3B |= (1<<CS31);
+/**
+* Returns the number of whole ticks that are not yet counted in current_tick:
+* those of the timer interrupts that came while the kernel was busy, those of
+* a window that has ended but whose interrupt is still pending (as in Now()),
+* and those that have passed in the current compare window. Must be called with
+* interrupts disabled, or a window may end in between.
+*/
+TICK Timer_Passed()
+{
+	TICK passed = DeferredTicks;
+	unsigned int count = Timer_Count();
 
-	//Set TOP value 0.0001s*MSECPERTICK
-	OCR3A = 2000*MSECPERTICK;
+	if (Timer_Window_Ended()) {
+		passed += timer_window;
+		count = Timer_Count();
+	}
+#if TICKLESS
+	passed += count / TIMER_COUNTS_PER_TICK;
+#else
+	(void)count;
+#endif
+	return passed;
+}
 
-	//Enable interupt A for timer 3.
-	TIMSK3 |= (1<<OCIE3A);
+/**
+* Returns the number of ticks from the start of the current compare window (i.e.
+* from current_tick) until the kernel has something to do:
+* the next periodic release, the WCET deadline of a released periodic task, or
+* the end of the running RR task's quantum when another RR task is waiting.
+*/
+static TICK Kernel_Next_Event()
+{
+	TICK next = TICKLESS_MAX_TICKS;
 
-	//Set timer to 0 (optional here).
-	TCNT3 = 0;
+	if (ReleaseQ.head != NULL && ReleaseQ.head->dq_delta < next) {
+		next = ReleaseQ.head->dq_delta;
+	}
+	if (SleepQ.head != NULL && SleepQ.head->dq_delta < next) {
+		next = SleepQ.head->dq_delta;
+	}
+	if (TimeTask != NULL && TimeTask->wcet - TimeTask->executed_ticks < next) {
+		next = TimeTask->wcet - TimeTask->executed_ticks;
+	}
+	// a release at delta 0 is due at the very next tick
+	if (next == 0) next = 1;
 
-	// enable interrupt
-	Enable_Interrupt();
+	if (Cp->py == RR && count(&ReadyQRR) > 0) {
+		TICK d = (Cp->executed_ticks < Cp->w) ? Cp->w - Cp->executed_ticks : 1;
+		if (d < next) next = d;
+	}
+	return next;
+}
+
+/**
+* Reprograms TIMER3 to fire on the next kernel event. The timer keeps counting
+* from the start of the current window, so the ticks already elapsed in this
+* window are still accounted for when it fires. Must be called with interrupts
+* disabled.
+* A window that has already ended is left alone: its interrupt is pending and
+* counts it with its own length, timer_window, then programs the next window.
+*/
+void Timer_Program()
+{
+	TICK next;
+	TICK passed;
+
+	if (Timer_Window_Ended()) return;
+
+	next = Kernel_Next_Event();
+	passed = Timer_Passed();
+	if (next <= passed) next = passed + 1;
+	Timer_Set_Compare(next * TIMER_COUNTS_PER_TICK - 1);
+	// never leave the compare value behind the counter, or right at it, or we lose
+	// a whole timer period
+	while (Timer_Count() + 1 >= Timer_Compare() && next < TICKLESS_MAX_TICKS) {
+		next++;
+		Timer_Set_Compare(next * TIMER_COUNTS_PER_TICK - 1);
+	}
+	// The old window may have ended just before the new compare value was set.
+	// Its interrupt must still count it with the old length then.
+	if (!Timer_Window_Ended()) timer_window = next;
 }
 
-void Kernel_Tick()
+/**
+* Advances the system time by "elapsed" ticks, releasing due periodic tasks and
+* checking the WCET of the running one. Only the released periodic task and the
+* tasks being released are touched, no matter how many tasks there are. If more
+* than one tick has elapsed, every release that became due in the meantime is
+* still made, in order.
+*/
+void Kernel_Tick(TICK elapsed)
 {
-	current_tick++;
-	int x;
-	int ready_time_tasks = 0;
-	for (x = 0; x < MAXPROCESS; x++) {
-		if (Process[x].py == TIME && Process[x].state != SUSPENDED){
-			Process[x].executed_ticks++;
-			if (Process[x].executed_ticks >= Process[x].wcet){
-				OS_Abort(ERROR_WCET_VIOLATION);
-			}
+	volatile PD* p;
+	TICK slept = elapsed;
+
+	current_tick += elapsed;
+
+	if (TimeTask != NULL) {
+		TimeTask->executed_ticks += elapsed;
+		if (TimeTask->executed_ticks >= TimeTask->wcet){
+			OS_Abort(ERROR_WCET_VIOLATION);
 		}
-		if (Process[x].state == SUSPENDED && Process[x].py == TIME && Process[x].next_schedule == current_tick)
-		{
-			Process[x].next_schedule = Process[x].next_schedule + Process[x].period;
-			setReady(&Process[x]);
+	}
+
+	while ((p = dq_pop_expired(&ReleaseQ, &elapsed)) != NULL) {
+		// The previous release of a time-based task has not finished yet
+		if (TimeTask != NULL) {
+			OS_Abort(ERROR_PERIODIC_TASK_COLLISION);
 		}
-		if (Process[x].py == TIME && (Process[x].state == RUNNING || Process[x].state == READY))
-		{
-			ready_time_tasks++;
+		// The next release is one period after this one, not after now
+		dq_insert(&ReleaseQ, p, p->period);
+		// "elapsed" is now the number of ticks since this release
+		p->executed_ticks = elapsed;
+		if (p->executed_ticks >= p->wcet){
+			OS_Abort(ERROR_WCET_VIOLATION);
 		}
+		TimeTask = p;
+		setReady(p);
 	}
-	if (ready_time_tasks > 1)
-	{
-		OS_Abort(ERROR_PERIODIC_TASK_COLLISION);
+	dq_advance(&ReleaseQ, elapsed);
+
+	while ((p = dq_pop_expired(&SleepQ, &slept)) != NULL) {
+		if (p->call == NULL) {
+			setReady(p);
+		} else if (p->call->request == SEM_WAIT || p->call->request == EVENT_WAIT
+			|| p->call->request == NOTIFY_WAIT) {
+			Kernel_Sync_Timeout(p);
+		} else {
+			Kernel_Chan_Timeout(p);
+		}
 	}
-	// if (Cp->py == TIME){
-	//   Cp->executed_ticks++;
-	//   if(Cp->executed_ticks >= Cp->wcet){
-	//     OS_Abort(ERROR_WCET_VIOLATION);
-	//   }
-	// }
-
+	dq_advance(&SleepQ, slept);
 }
 
-// This ISR fires every MSECPERTICKms and represents our RTOS tick
-ISR(TIMER3_COMPA_vect)
+// This ISR fires at the end of every compare window, i.e. every MSECPERTICKms, or
+// in tickless mode whenever the next kernel event is due.
+ISR(TIMER_ISR)
 {
-	Kernel_Tick();
-	if (Cp->py >= RR)
+	if (InKernel) {
+		// the kernel counts these ticks before it switches to a task
+#if TICKLESS
+		DeferredTicks += timer_window;
+#else
+		DeferredTicks++;
+#endif
+		return;
+	}
+#if TICKLESS
+	TICK elapsed = timer_window;
+	Kernel_Tick(elapsed);
+	Timer_Program();
+	if (Cp->py == RR)
+	{
+		// the quantum is counted in ticks, Task_Next_2() counts the last one
+		Cp->executed_ticks += elapsed - 1;
+	}
+#else
+	Kernel_Tick(1);
+#endif
+	Kernel_Drain_Posts();
+	if (Cp_Preempted())
+	{
+		// e.g. a System task woke up from Task_Sleep(), it preempts the periodic
+		// task, or a WRR task in the middle of its quantum, which is charged this tick
+		if (Cp->py == RR) Cp->executed_ticks++;
+		Task_Preempt();
+	}
+	else if (Cp->py >= RR)
 	{
-		Task_Next_2();
+		// preemption saves the full context, unlike a voluntary Task_Next()
+		if (Cp_Quantum_Expired()) Task_Preempt();
 	}
 }
 
-void Init_Debug_LEDs()
+/**
+* The end of an ISR that has posted to the kernel. The kernel makes the posted
+* calls right away, and if they made a task ready that preempts the interrupted
+* one, the interrupted task is preempted like by the timer. Otherwise the ISR
+* simply returns to it. Either way, the kernel is entered at most once.
+*/
+void ISR_Exit()
 {
-	DDRL |= (1<<PL2);
-	DDRL |= (1<<PL3);
-	DDRL |= (1<<PL4);
-	DDRC = 0xFF;
-	// DDRA |= (1<<PA0);
-	// DDRA |= (1<<PA1);
-	// DDRA |= (1<<PA2);
-	// DDRA |= (1<<PA3);
-	// DDRA |= (1<<PA4);
-	// DDRA |= (1<<PA5);
-	// DDRA |= (1<<PA6);
-	// DDRA |= (1<<PA7);
-	// DDRB |= (1<<PB0);
+	// the kernel handles the posts itself before it switches to a task
+	if (!KernelActive || InKernel) return;
+	Kernel_Drain_Posts();
+	if (Cp_Preempted()) {
+		Task_Preempt();
+	} else {
+#if TICKLESS
+		// we may have readied a task, which changes the next timer event
+		Timer_Program();
+#endif
+	}
 }
 
+/**
+* Runs when nothing else is ready. The CPU sleeps until the next interrupt; IDLE
+* mode keeps TIMER3 running, so the kernel still wakes up for its next event.
+*/
 void Idle_Task()
 {
-	for(;;){}
+	for(;;){
+		Cpu_Idle();
+	}
 }
 
 /**
@@ -1047,12 +3723,12 @@ void Idle_Task()
 int main()
 {
 	OS_Init();
-	Init_Debug_LEDs();
+	Port_Debug_Init();
 	// Here we create a task for a_main which should be defined externally to create
 	// all tasks needed for the application, and then terminate.
 	// #TODO this should be created as a system task once we implement this functionality
 	Task_Create_Idle(Idle_Task, 0);
-	Task_Create_System( a_main , PL2);
+	Task_Create_System( a_main , A_MAIN_ARG);
 	Timer_Init();
 	OS_Start();
 }
@@ -2,14 +2,72 @@
 #ifndef _OS_H_
 #define _OS_H_
 
+#ifndef MAXPROCESS
 #define MAXPROCESS     16
-#define WORKSPACE     256   // in bytes, per THREAD
+#endif
+#ifndef WORKSPACE
+#define WORKSPACE     256   // in bytes, default stack size of a THREAD
+#endif
+#ifndef STACK_ARENA
+#define STACK_ARENA   (MAXPROCESS * WORKSPACE)   // in bytes, shared by all THREAD stacks
+#endif
 #define MAXCHAN       16
+#ifndef MAXRECVANY
+#define MAXRECVANY     4   // most CHANs one Recv_Any() waits on, each takes a WAIT_NODE on the caller's stack
+#endif
+#ifndef MSG_SIZE
+#define MSG_SIZE      16   // in bytes, size of every message of the message pool
+#endif
+#ifndef MSG_COUNT
+#define MSG_COUNT      8   // number of messages in the message pool
+#endif
+#ifndef MAXPOOL
+#define MAXPOOL        4
+#endif
+#ifndef MAXMUTEX
+#define MAXMUTEX       8
+#endif
+#ifndef MAXSEM
+#define MAXSEM         8
+#endif
+#ifndef MAXEVENT
+#define MAXEVENT       4
+#endif
+#ifndef POOL_MEMORY
+#define POOL_MEMORY  256   // in bytes, shared by the blocks of all POOLs
+#endif
+#ifndef CHAN_BUFFERS
+#define CHAN_BUFFERS  64   // in ints, shared by the buffers of all buffered CHANs
+#endif
+#ifndef ISR_POSTS
+#define ISR_POSTS      8   // posts from ISRs the kernel has not handled yet, plus 1
+#endif
+#ifndef HEAP_SIZE
+#define HEAP_SIZE    512   // in bytes, the heap of Mem_Alloc()
+#endif
 #define MSECPERTICK   10   // resolution of a system TICK in milliseconds
+#ifndef TICKLESS
+#define TICKLESS       0   // 1: TIMER3 only fires for the next kernel event, 0: fires every TICK
+#endif
+#ifndef STACK_WATERMARK
+#define STACK_WATERMARK 0  // 1: paints every new stack for Task_StackUnused(), with interrupts off, 0: only its guard
+#endif
+#ifndef IRQ_TRACE
+#define IRQ_TRACE      0   // 1: records the longest time the RTOS disables interrupts, see Irq_GetStats()
+#endif
 
+#ifdef HOST_PORT
+// Linux host port: interrupts are signals (see host/port_host.h)
+void Host_Disable_Interrupt(void);
+void Host_Enable_Interrupt(void);
+#define Disable_Interrupt()    Host_Disable_Interrupt()
+#define Enable_Interrupt()     Host_Enable_Interrupt()
+#define NoOperation()
+#else
 #define Disable_Interrupt()    asm volatile ("cli"::)
 #define Enable_Interrupt()     asm volatile ("sei"::)
 #define NoOperation()		   asm volatile ("nop"::)
+#endif
 
 
 #ifndef NULL
@@ -24,6 +82,12 @@ typedef unsigned int WEIGHT;     // always non-zero if it is valid
 typedef unsigned int CHAN;       // always non-zero if it is valid
 typedef unsigned int TICK;       // 1 TICK is defined by MSECPERTICK
 typedef unsigned int BOOL;       // TRUE or FALSE
+typedef unsigned int POOL;       // always non-zero if it is valid
+typedef unsigned int MUTEX;      // always non-zero if it is valid
+typedef unsigned int SEM;        // always non-zero if it is valid
+typedef unsigned int EVENT;      // always non-zero if it is valid
+
+#define WAIT_FOREVER  ((TICK)~0U)   // a timeout that waits as long as it takes
 
 
 // Aborts the RTOS and enters a "non-executing" state with an error code. That is, all tasks
@@ -63,6 +127,19 @@ PID   Task_Create_RR(    void (*f)(void), int arg);
    */
 PID   Task_Create_Period(void (*f)(void), int arg, TICK period, TICK wcet, TICK offset);
 
+/*
+ * Task stacks are allocated from a single arena of STACK_ARENA bytes. The functions
+ * above give each task WORKSPACE bytes; the ones below take the stack size in bytes
+ * instead, so that small tasks leave room for more tasks. A stack is rounded up to
+ * a minimum size, which allows for the frame of an interrupt. When a task
+ * terminates, its stack goes back to the arena. They return 0 if there is no
+ * free PD or not enough stack space left.
+ */
+PID   Task_Create_System_Stack(void (*f)(void), int arg, unsigned int stack_size);
+PID   Task_Create_WRR_Stack(void (*f)(void), int arg, WEIGHT w, unsigned int stack_size);
+PID   Task_Create_RR_Stack(    void (*f)(void), int arg, unsigned int stack_size);
+PID   Task_Create_Period_Stack(void (*f)(void), int arg, TICK period, TICK wcet, TICK offset, unsigned int stack_size);
+
 // NOTE: When a task function returns, it terminates automatically!!
 
 // When a Periodic ask calls Task_Next(), it will resume at the beginning of its next period.
@@ -71,10 +148,33 @@ PID   Task_Create_Period(void (*f)(void), int arg, TICK period, TICK wcet, TICK
 //
 void Task_Next(void);
 
+/*
+ * A System or RR task may sleep without using the CPU. Task_Sleep() sleeps for "t" TICKs,
+ * Task_SleepUntil() sleeps until Now() reaches "t" milliseconds. Sleeping for 0 TICKs is
+ * the same as Task_Next(). When a sleeping task wakes up it is put at the end of its
+ * ready queue. Periodic tasks are NOT allowed to sleep; they use Task_Next() instead.
+ */
+void Task_Sleep(TICK t);
+void Task_SleepUntil(unsigned int t);
+
 
 // The calling task gets its initial "argument" when it was created.
 int  Task_GetArg(void);
 
+// The PID of the calling task, e.g. for other tasks to Task_Notify() it.
+PID  Task_GetPid(void);
+
+#if STACK_WATERMARK
+/*
+ * Returns how many bytes of the stack of task "p" have never been used so far, i.e.
+ * its stack could be that much smaller. Run the application through its worst case
+ * before relying on it. It is only there if STACK_WATERMARK is set, as painting every
+ * new stack slows down Task_Create(). A task that runs out of stack makes the RTOS
+ * abort with error 0x80 | its PID either way.
+ */
+unsigned int Task_StackUnused(PID p);
+#endif
+
 /*
  * A CHAN is a one-way communication channel between at least two tasks. It must be
  * initialized before its use. Chan_Init() returns a CHAN if successful; otherwise
@@ -104,6 +204,29 @@ CHAN Chan_Init();
 void Send( CHAN ch, int v );  // blocking send on CHAN
 int Recv( CHAN ch );          // blocking receive on CHAN
 
+/*
+ * Send_Timeout() and Recv_Timeout() are a Send() and a Recv() that give up after "t"
+ * TICKs, so that a task is not stuck forever when its peer is gone. They return TRUE
+ * if the value was sent, or received into "*v", and FALSE if they timed out. Like
+ * Task_Sleep(), the timeout counts from the start of the current TICK.
+ * A timeout of 0 is a try that never blocks: Send_Timeout() only succeeds if a receiver
+ * is waiting or there is room in the buffer, and Recv_Timeout() only if a value is
+ * buffered or a sender is waiting. Periodic tasks may try, but not use a longer timeout.
+ */
+BOOL Send_Timeout( CHAN ch, int v, TICK t );
+BOOL Recv_Timeout( CHAN ch, int *v, TICK t );
+
+/*
+ * A task serving several CHANs waits on all of them at once with Recv_Any(). It is a
+ * Recv() on the first of the "n" CHANs in "chs" that has a value or a waiting sender.
+ * If none has, the task waits on all of them until one is sent or written to. It
+ * returns the value, and the CHAN it came from in "*ch" unless "ch" is NULL. The task
+ * receives one value only, from one CHAN; it no longer waits on the others. "chs" must
+ * stay valid until Recv_Any() returns. "n" must not exceed MAXRECVANY, or the RTOS
+ * aborts. Periodic tasks must not use it.
+ */
+int Recv_Any( const CHAN *chs, unsigned int n, CHAN *ch );
+
 /*
  * A sender may not be willing to wait for one or more receiver to communicate.
  * A sender calling Write() on a CHAN will resume one or more receiver if they are waiting,
@@ -113,10 +236,226 @@ int Recv( CHAN ch );          // blocking receive on CHAN
  * A Write() is essentially the same as Send() except that the sender is not blocking.
  * Periodic tasks may use Write() to communicate with other tasks.
  *
- * Note: It is possible that an ISR may use Write() to resume a waiting receiving task.
+ * Note: An ISR must not use Write(), as it may enter the kernel on behalf of the task it
+ * interrupted. It uses Write_FromISR() instead, see below.
  */
 void Write( CHAN ch, int v );   // non-blocking send on CHAN
 
+/*
+ * An ISR wakes up tasks by posting to the kernel: Write_FromISR() is a Write() that only
+ * adds the value to a queue of ISR_POSTS - 1 posts. It returns FALSE if the queue is
+ * full, and the value is lost. Like a Write(), the value is also lost if the CHAN is
+ * unbuffered and no receiver is waiting when the kernel handles the post, so a task
+ * that is not yet back in Recv() misses the interrupt. Use a buffered CHAN, or
+ * Sem_Signal_FromISR() or Task_Notify_FromISR(), which are counted or latched, if every
+ * interrupt must be seen. The ISR must call ISR_Exit() as its last statement. The
+ * kernel then handles all the posts, and if any of them made a task ready that has a
+ * higher priority than the interrupted one, switches to it right away, not at the next
+ * TICK. A System task waiting in Recv() thus runs as soon as the ISR returns.
+ * ISR_Exit() also switches to a task that Pool_Free() made ready from the same ISR.
+ * Sem_Signal_FromISR(), Event_Set_FromISR() and Task_Notify_FromISR() post in the same
+ * way, see below.
+ */
+BOOL Write_FromISR( CHAN ch, int v );
+void ISR_Exit( void );
+
+/*
+ * A buffered CHAN holds up to "capacity" values in a ring buffer, in FIFO order. A sender
+ * only blocks in Send() if the buffer is full, and a receiver only blocks in Recv() if it
+ * is empty. Write() buffers the value if there is room, and drops it otherwise. Unlike
+ * an unbuffered CHAN, every value is received by exactly one receiver; receivers take
+ * turns in the order they arrived. The buffers of all CHANs share CHAN_BUFFERS ints.
+ * Chan_Init_Buffered() returns 0 if there is not enough buffer space left, and a
+ * capacity of 0 is the same as Chan_Init().
+ * Periodic tasks may only use Write() on a buffered CHAN.
+ */
+CHAN Chan_Init_Buffered(unsigned int capacity);
+
+/*
+ * Messages pass more than an int over a CHAN without copying it. Msg_Alloc() takes a
+ * MSG_SIZE byte message from a pool of MSG_COUNT, or returns NULL if they are all in use.
+ * The sender fills it in and passes it with Msg_Send() or Msg_Write(), which work like
+ * Send() and Write(). From then on, the message belongs to the receiver(s): the sender
+ * must not touch it any more. A receiver gets it from Msg_Recv(), and must call
+ * Msg_Free() when it is done with it. When a message is multicast, it goes back to the
+ * pool after its last receiver has freed it. A message that nobody receives, e.g. a
+ * Msg_Write() without receivers, goes back to the pool right away.
+ * A CHAN must be used either for messages or for ints, never both.
+ */
+void *Msg_Alloc(void);
+void  Msg_Free(void *msg);
+void  Msg_Send(CHAN ch, void *msg);
+void  Msg_Write(CHAN ch, void *msg);
+void *Msg_Recv(CHAN ch);
+
+/*
+ * A POOL is a fixed number of memory blocks of the same size, for memory that tasks and
+ * ISRs allocate and free at run time. Pool_Create() returns 0 if there are MAXPOOL
+ * pools already, or not enough of the POOL_MEMORY bytes shared by all pools is left.
+ * Pools cannot be deleted. Allocating and freeing a block take constant time.
+ * Pool_Alloc() returns NULL if all blocks are in use; Pool_Alloc_Wait() blocks until a
+ * block is freed, and the waiting tasks get blocks in the order they arrived. Pool_Free()
+ * must be given the POOL the block came from.
+ * Pool_Alloc(), Pool_Free() and Pool_GetStats() may be called from an ISR, which then ends
+ * with ISR_Exit(). Periodic tasks must not use Pool_Alloc_Wait().
+ * The counters tell how large a pool has to be: the most blocks that were ever in use at
+ * the same time, and the number of allocations that found the pool empty.
+ */
+typedef struct {
+	unsigned int block_size;   // in bytes, rounded up for alignment
+	unsigned int count;
+	unsigned int used;
+	unsigned int high_water;
+	unsigned int failures;
+} POOL_STATS;
+
+POOL  Pool_Create(unsigned int block_size, unsigned int count);
+void *Pool_Alloc(POOL p);
+void *Pool_Alloc_Wait(POOL p);
+void  Pool_Free(POOL p, void *block);
+void  Pool_GetStats(POOL p, POOL_STATS *stats);
+
+/*
+ * A MUTEX guards a resource that tasks share, e.g. a UART or a struct, without disabling
+ * interrupts. Mutex_Init() returns 0 if there are MAXMUTEX mutexes already; they cannot
+ * be deleted. Only the task that locked a mutex may unlock it, and it must not lock it
+ * again before, or terminate while holding it.
+ * Locking a free mutex and unlocking one nobody waits for take constant time and do not
+ * enter the kernel. A task that finds the mutex locked blocks until it is its turn; the
+ * highest priority waiter is next, and waiters of the same priority go in the order they
+ * came. Periodic tasks must not block, so they may only lock a free mutex, and must unlock
+ * it before they call Task_Next(); the RTOS aborts otherwise.
+ * While a task waits, the owner inherits its priority: e.g. a RR task holding a mutex that
+ * a System task waits for runs as a System task, so that neither a periodic task nor other
+ * RR tasks can delay the System task any longer than the owner's critical section. As it
+ * unlocks, the owner drops back to its own priority, or to what it still inherits through
+ * other mutexes it holds, and the highest waiter becomes the owner right away. If the
+ * owner waits for another mutex in turn, that mutex's owner inherits the priority as
+ * well, and if it waits for a SEM, it moves up among the SEM's waiters. Mutexes must not
+ * be used from ISRs.
+ */
+MUTEX Mutex_Init(void);
+void  Mutex_Lock(MUTEX m);
+void  Mutex_Unlock(MUTEX m);
+
+/*
+ * A SEM is a counting semaphore, for signalling that something is ready without passing
+ * a value. Sem_Init() returns 0 if there are MAXSEM of them already. Sem_Signal() wakes
+ * the first waiting task, or adds one to the count if nobody waits. Sem_Wait() takes one
+ * from the count, and blocks while it is 0; the highest priority waiter is woken first,
+ * and waiters of the same priority in the order they came. Sem_Wait_Timeout() gives up
+ * after "t" TICKs and returns FALSE if it did, and with a "t" of 0 it only tries.
+ * Signalling without waiters, and waiting on a count above 0, take constant time and do
+ * not enter the kernel; neither does waking a task that does not preempt the caller.
+ * This makes a SEM cheaper than a CHAN for plain signalling.
+ * Periodic tasks may signal, and may try with a timeout of 0, but must not block. An ISR
+ * uses Sem_Signal_FromISR() instead, which posts like Write_FromISR().
+ */
+SEM   Sem_Init(unsigned int count);
+void  Sem_Signal(SEM s);
+void  Sem_Wait(SEM s);
+BOOL  Sem_Wait_Timeout(SEM s, TICK t);
+BOOL  Sem_Signal_FromISR(SEM s);
+
+/*
+ * An EVENT is a group of 16 flags (of an unsigned int) that tasks wait on. Event_Init()
+ * returns 0 if there are MAXEVENT of them already; all flags start cleared.
+ * Event_Set() sets "flags" and wakes every task whose wait is now satisfied, and
+ * Event_Clear() clears them; it returns the flags as they were before, so
+ * Event_Clear(e, 0) reads them. Event_Wait() waits until any of "flags" is set, or all
+ * of them with EVENT_ALL in "mode". With EVENT_CLEAR in "mode", it clears the flags it
+ * waited for as it returns; tasks woken by the same Event_Set() all see them first. It
+ * returns those of "flags" that were set, which is never 0. Event_Wait_Timeout() returns
+ * 0 if it gave up after "t" TICKs, or if "t" is 0 and the wait is not satisfied yet.
+ * "flags" must not be 0. Waking tasks takes time in proportion to the number of waiters.
+ * Setting flags that wake nobody who preempts the caller does not enter the kernel.
+ * Periodic tasks may set and clear flags, and may wait with a timeout of 0 only. An ISR
+ * uses Event_Set_FromISR(), which posts like Write_FromISR().
+ */
+#define EVENT_ANY      0
+#define EVENT_ALL      1
+#define EVENT_CLEAR    2
+
+EVENT Event_Init(void);
+void  Event_Set(EVENT e, unsigned int flags);
+unsigned int Event_Clear(EVENT e, unsigned int flags);
+unsigned int Event_Wait(EVENT e, unsigned int flags, unsigned int mode);
+unsigned int Event_Wait_Timeout(EVENT e, unsigned int flags, unsigned int mode, TICK t);
+BOOL  Event_Set_FromISR(EVENT e, unsigned int flags);
+
+/*
+ * Every task has a notification value, which other tasks and ISRs change by its PID,
+ * without a CHAN or any other object. Task_Notify() changes the value of task "p" by
+ * "action": NOTIFY_SET_BITS ors "v" into it, NOTIFY_INCREMENT adds 1 and ignores "v",
+ * and NOTIFY_OVERWRITE sets it to "v". It returns FALSE if there is no task "p".
+ * Task_Notify_Wait() waits until the calling task has been notified since it last took
+ * a notification, then returns TRUE with the value in "*v", unless "v" is NULL. This is
+ * the value as it runs again, so it includes notifications that came after the first. It
+ * clears the bits in "clear" as it returns, e.g. ~0 to start again from 0. It returns
+ * FALSE if it gave up after "t" TICKs; WAIT_FOREVER waits as long as it takes, and 0
+ * only takes a pending notification. A new task starts with a value of 0.
+ * Both take constant time, and the kernel is only entered to block, or to switch to a
+ * notified task that preempts the caller. Any task may notify. Periodic tasks may wait
+ * with a timeout of 0 only. An ISR uses Task_Notify_FromISR(), which posts like
+ * Write_FromISR().
+ */
+#define NOTIFY_SET_BITS    0
+#define NOTIFY_INCREMENT   1
+#define NOTIFY_OVERWRITE   2
+
+BOOL  Task_Notify(PID p, unsigned int v, unsigned int action);
+BOOL  Task_Notify_Wait(unsigned int clear, unsigned int *v, TICK t);
+BOOL  Task_Notify_FromISR(PID p, unsigned int v, unsigned int action);
+
+/*
+ * Mem_Alloc() allocates "size" bytes of any size from a heap of HEAP_SIZE bytes, and
+ * returns NULL if there is no free block large enough. Unlike malloc(), allocating and
+ * freeing take a bounded time however full or fragmented the heap is, so any task,
+ * including a Periodic one, and an ISR may call them. Mem_Alloc() never blocks. Each
+ * block costs a few bytes of header on top of its size.
+ * Task_HeapUsed() tells how many bytes are allocated by task "p". A block is counted for
+ * the task that allocated it until it is freed, by any task; a block allocated from an
+ * ISR is counted for the task it interrupted. A PID is reused after a task terminates,
+ * so blocks that a terminated task did not free are counted for the next task with its PID.
+ * Mem_GetStats() reports how fragmented the heap is: "largest_free" is the largest block
+ * that Mem_Alloc() can return, which can be much less than "free". Mem_GetStats() is
+ * NOT for real-time use: unlike the other calls it walks every block of the heap with
+ * interrupts disabled, so the interrupt latency it adds grows with the number of blocks.
+ * Call it from a low priority task to diagnose the heap, never from an ISR or a task
+ * with a deadline.
+ */
+typedef struct {
+	unsigned int free;           // in bytes
+	unsigned int used;           // in bytes, not counting the headers
+	unsigned int largest_free;   // in bytes
+	unsigned int free_blocks;
+	unsigned int used_blocks;
+} MEM_STATS;
+
+void *Mem_Alloc(unsigned int size);
+void  Mem_Free(void *p);
+unsigned int Task_HeapUsed(PID p);
+void  Mem_GetStats(MEM_STATS *stats);
+
+/*
+ * The kernel itself runs with interrupts enabled; it only disables them to enter and
+ * leave the kernel, and around the few updates that an ISR may also make. An ISR that
+ * interrupts the kernel leaves its work (a timer tick, posts) to the kernel, which does
+ * it before it switches to a task.
+ * With IRQ_TRACE set to 1, every time the RTOS disables interrupts is measured, and
+ * Irq_GetStats() returns the longest such window so far: how long it was, and the lines
+ * of os.c where interrupts were disabled and enabled again. Time spent in ISRs is not
+ * included, as the hardware disables interrupts there, not the RTOS.
+ */
+typedef struct {
+	unsigned int max_us;         // longest time interrupts were disabled, in microseconds
+	const char *file;
+	unsigned int line;           // where that window began
+	unsigned int end_line;       // where interrupts were enabled again
+} IRQ_STATS;
+
+void  Irq_GetStats(IRQ_STATS *stats);
+
 
 /**
   * Returns the number of milliseconds since OS_Init(). Note that this number
@@ -0,0 +1,106 @@
+/*
+ * port.h
+ *
+ * The hardware dependent part of the RTOS: interrupt masking, TIMER3, the
+ * initial frame of a task and the debug pins. os.c only talks to the hardware
+ * through the macros and functions declared here, so the same kernel source
+ * also builds for the Linux host port (see host/port_host.h).
+ */
+#ifndef _PORT_H_
+#define _PORT_H_
+
+#include "os.h"
+
+#ifdef HOST_PORT
+#include "host/port_host.h"
+#else
+
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "avr/sleep.h"
+#define F_CPU 16000000
+#include "util/delay.h"
+
+#define KERNEL_DEBUG_PIN PL4
+#define OS_ABORT_DEBUG_PORT PORTC
+
+// Argument given to a_main(), its debug pin
+#define A_MAIN_ARG PL2
+
+/**
+* Saving and restoring the interrupt state, for code that may run with
+* interrupts already disabled (e.g. from an ISR).
+*/
+typedef unsigned char IRQ_STATE;
+#define Save_Interrupt()        SREG
+#define Restore_Interrupt(s)    (SREG = (s))
+#define Interrupts_Enabled(s)   ((s) & (1<<SREG_I))
+
+#define Debug_Kernel_Entry()    (PORTL = (1<<KERNEL_DEBUG_PIN))
+#define Debug_Abort(error)      (OS_ABORT_DEBUG_PORT = (error))
+
+/**
+* TIMER3 resolution. In tickless mode the timer is slowed down to 1/64 so that
+* a single compare window can cover several TICKs (26 TICKs at 10 ms).
+*/
+#if TICKLESS
+#define TIMER_COUNTS_PER_MS    250    // 16 MHz / 64
+#else
+#define TIMER_COUNTS_PER_MS    2000   // 16 MHz / 8
+#endif
+
+/**
+* TIMER3 runs in CTC mode: it counts from 0 up to the compare value, then
+* TIMER_ISR fires and the count (a new compare window) starts over at 0.
+*/
+#define TIMER_ISR               TIMER3_COMPA_vect
+#define Timer_Count()           TCNT3
+#define Timer_Compare()         OCR3A
+#define Timer_Set_Compare(c)    (OCR3A = (c))
+#define Timer_Window_Ended()    (TIFR3 & (1<<OCF3A))
+
+// A free-running clock for IRQ_TRACE, TIMER5 at 16 MHz / 8; wraps after 32 ms
+#define Trace_Clock()           TCNT5
+#define TRACE_COUNTS_PER_US     2
+
+// Sleeps until the next interrupt, TIMER3 keeps running
+#define Cpu_Idle()              do { set_sleep_mode(SLEEP_MODE_IDLE); sleep_mode(); } while (0)
+
+/**
+* Frame types, i.e. the byte on top of a suspended task's stack telling
+* Exit_Kernel() how its context was saved (See file "cswitch.s" for details.)
+*/
+#define FRAME_FULL        0
+#define FRAME_VOLUNTARY   1
+
+/**
+* The smallest stack a task can have, in bytes. The timer ISR runs on the stack
+* of the task it interrupts, and may save that task's full context on top.
+*/
+#define PORT_MIN_STACK    128
+
+#endif /* HOST_PORT */
+
+/**
+* Starts TIMER3 with a first compare window of "compare" + 1 timer counts.
+*/
+void Port_Timer_Init(unsigned int compare);
+
+/**
+* Starts the clock of Trace_Clock(), only used if IRQ_TRACE is set.
+*/
+void Port_Trace_Init(void);
+
+/**
+* Sets up the debug pins.
+*/
+void Port_Debug_Init(void);
+
+/**
+* Builds the initial context of a task on the "size" bytes of "stack", so
+* that switching to it starts "f", and returning from "f" calls "terminate".
+* Returns the task's initial stack pointer.
+*/
+unsigned char *Port_Init_Frame(unsigned char *stack, unsigned int size, void (*f)(void), void (*terminate)(void));
+
+#endif /* _PORT_H_ */
@@ -0,0 +1,97 @@
+/*
+ * port_avr.c
+ *
+ * The ATmega2560 port of the RTOS, see port.h. The context switch itself is
+ * in cswitch.s.
+ */
+#ifndef HOST_PORT
+#include <avr/pgmspace.h>
+#include "port.h"
+
+void Port_Timer_Init(unsigned int compare)
+{
+	//Clear timer config.
+	TCCR3A = 0;
+	TCCR3B = 0;
+	//Set to CTC (mode 4)
+	TCCR3B |= (1<<WGM32);
+
+#if TICKLESS
+	//Set prescaller to 1/64, so that a compare window can span many ticks
+	TCCR3B |= (1<<CS31) | (1<<CS30);
+#else
+	//Set prescaller to 1/8
+	TCCR3B |= (1<<CS31);
+#endif
+
+	//Set TOP value
+	OCR3A = compare;
+
+	//Enable interupt A for timer 3.
+	TIMSK3 |= (1<<OCIE3A);
+
+	//Set timer to 0 (optional here).
+	TCNT3 = 0;
+}
+
+void Port_Trace_Init()
+{
+	//Normal mode, counts up to 0xFFFF and wraps around
+	TCCR5A = 0;
+	TCCR5B = (1<<CS51);   //Set prescaller to 1/8
+	TCNT5 = 0;
+}
+
+void Port_Debug_Init()
+{
+	DDRL |= (1<<PL2);
+	DDRL |= (1<<PL3);
+	DDRL |= (1<<PL4);
+	DDRC = 0xFF;
+	// DDRA |= (1<<PA0);
+	// DDRA |= (1<<PA1);
+	// DDRA |= (1<<PA2);
+	// DDRA |= (1<<PA3);
+	// DDRA |= (1<<PA4);
+	// DDRA |= (1<<PA5);
+	// DDRA |= (1<<PA6);
+	// DDRA |= (1<<PA7);
+	// DDRB |= (1<<PB0);
+}
+
+/**
+* The initial frame, from its lowest address up: the frame type, SREG with
+* interrupts enabled, the other 33 registers, which start out as 0 (r1 in
+* particular must be 0 for C code), then the 3 byte return addresses of "f"
+* and of "terminate", which are filled in for every task.
+*/
+#define FRAME_SIZE  41
+static const unsigned char FrameTemplate[FRAME_SIZE] PROGMEM = { FRAME_FULL, (1 << 7) };
+
+/**
+* The initial frame looks just like the task has been preempted by
+* Enter_Kernel() right at the start of "f".
+*/
+unsigned char *Port_Init_Frame(unsigned char *stack, unsigned int size, void (*f)(void), void (*terminate)(void))
+{
+	unsigned char *frame = &(stack[size - FRAME_SIZE]);
+
+	memcpy_P(frame, FrameTemplate, FRAME_SIZE);
+
+	//Notice that the addresses (16-bit) of the functions are stored most
+	//significant byte first, i.e. at the lower address. This is because the
+	//"return" assembly instructions (rtn and rti) pop addresses off in BIG
+	//ENDIAN, even though the AT90 is LITTLE ENDIAN machine.
+
+	//Place return address of function at bottom of stack
+	frame[36] = (((unsigned int)f) >> 8) & 0xff;
+	frame[37] = ((unsigned int)f) & 0xff;
+
+	//Store terminate at the bottom of stack to protect against stack underrun.
+	frame[39] = (((unsigned int)terminate) >> 8) & 0xff;
+	frame[40] = ((unsigned int)terminate) & 0xff;
+
+	//The stack pointer points at the first free byte, below the frame
+	return frame - 1;
+}
+#endif /* HOST_PORT */
@@ -0,0 +1,52 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define TASK1_PORT PA0
+#define TASK2_PORT PA1
+#define ERROR_PORT PA2
+
+volatile CHAN chan_comm;
+
+// This test ensures that a buffered CHAN only blocks when it has to
+// The sender fills the 4 value buffer without blocking and only blocks on the 5th Send().
+// The receiver then takes all 5 values in order without blocking, until the buffer is empty.
+// Execution order: [T2 (4 sends), T1 (5 receives), T2]
+// ERROR_PORT goes high if a value arrives out of order.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<TASK1_PORT);
+	DDRA |= (1<<TASK2_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+// Receiving task
+void Task_1()
+{
+	int i;
+	PORTA |= (1<<TASK1_PORT);
+	for (i = 0; i < 5; i++) {
+		if (Recv( chan_comm ) != i) PORTA |= (1<<ERROR_PORT);
+	}
+	PORTA &= ~(1<<TASK1_PORT);
+}
+
+// Sending task
+void Task_2()
+{
+	int i;
+	PORTA |= (1<<TASK2_PORT);
+	for (i = 0; i < 5; i++) {
+		Send( chan_comm, i );
+	}
+	PORTA &= ~(1<<TASK2_PORT);
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_comm = Chan_Init_Buffered(4);
+	Task_Create_RR(Task_2, 0);
+	Task_Create_RR(Task_1, 0);
+}
@@ -0,0 +1,70 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define TASK1_PORT PA0
+#define TASK2_PORT PA1
+#define TASK3_PORT PA2
+#define ERROR_PORT PA3
+
+typedef struct {
+	unsigned int seq;
+	unsigned char samples[8];
+} SAMPLES;
+
+volatile CHAN chan_comm;
+
+// This test ensures that a message is multicast without copying, and goes back to the
+// pool after the last receiver is done with it.
+// Task_3 sends every message to both receivers with Msg_Write(). If a message was not
+// freed, the pool runs out after MSG_COUNT messages and ERROR_PORT goes high.
+// Execution order: [T1, T2, T3, [T1, T2, T3]...]
+
+void init_debug_pins()
+{
+	DDRA |= (1<<TASK1_PORT);
+	DDRA |= (1<<TASK2_PORT);
+	DDRA |= (1<<TASK3_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+// Receiving tasks, Task_GetArg() is their debug pin
+void Task_Receiver()
+{
+	unsigned char pin = Task_GetArg();
+	for(;;) {
+		SAMPLES *m = Msg_Recv( chan_comm );
+		PORTA ^= (1<<pin);
+		if (m->samples[7] != (unsigned char)m->seq) PORTA |= (1<<ERROR_PORT);
+		Msg_Free(m);
+	}
+}
+
+// Sending task
+void Task_3()
+{
+	unsigned int seq = 0;
+	int i;
+	for(;;) {
+		SAMPLES *m = Msg_Alloc();
+		if (m == NULL) {
+			PORTA |= (1<<ERROR_PORT);
+			Task_Next();
+			continue;
+		}
+		m->seq = ++seq;
+		for (i = 0; i < 8; i++) m->samples[i] = seq;
+		PORTA ^= (1<<TASK3_PORT);
+		Msg_Write( chan_comm, m );
+		Task_Next();
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_comm = Chan_Init();
+	Task_Create_RR(Task_Receiver, TASK1_PORT);
+	Task_Create_RR(Task_Receiver, TASK2_PORT);
+	Task_Create_RR(Task_3, 0);
+}
@@ -0,0 +1,70 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define SERVER_PORT PA0
+#define CHAN1_PORT  PA1
+#define CHAN2_PORT  PA2
+#define ERROR_PORT  PA3
+
+volatile CHAN chan_1;
+volatile CHAN chan_2;
+
+// This test has one server task receive from two channels with Recv_Any(), instead of a
+// task per channel. A periodic task writes to the first channel every 10 ticks, and a RR
+// task sends to the second one and sleeps for 3 ticks.
+// The expected behaviour is PA1 toggling every 10 ticks, PA2 toggling every 3 ticks,
+// and PA3 never going high, i.e. every value arrives on the channel it was sent on.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<SERVER_PORT);
+	DDRA |= (1<<CHAN1_PORT);
+	DDRA |= (1<<CHAN2_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+// Serves both channels
+void Task_Server()
+{
+	CHAN chans[2];
+	CHAN ch;
+	int v;
+
+	chans[0] = chan_1;
+	chans[1] = chan_2;
+	for(;;) {
+		PORTA &= ~(1<<SERVER_PORT);
+		v = Recv_Any(chans, 2, &ch);
+		PORTA |= (1<<SERVER_PORT);
+		if (v != ch) PORTA |= (1<<ERROR_PORT);
+		if (ch == chan_1) PORTA ^= (1<<CHAN1_PORT);
+		if (ch == chan_2) PORTA ^= (1<<CHAN2_PORT);
+	}
+}
+
+void Task_Periodic()
+{
+	for(;;) {
+		Write(chan_1, chan_1);
+		Task_Next();
+	}
+}
+
+void Task_Sender()
+{
+	for(;;) {
+		Send(chan_2, chan_2);
+		Task_Sleep(3);
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_1 = Chan_Init();
+	chan_2 = Chan_Init();
+	Task_Create_RR(Task_Server, 0);
+	Task_Create_RR(Task_Sender, 0);
+	Task_Create_Period(Task_Periodic, 0, 10, 1, 1);
+}
@@ -0,0 +1,74 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define TIMEOUT_PORT  PA0
+#define RECEIVED_PORT PA1
+#define POLL_PORT     PA2
+#define ERROR_PORT    PA3
+
+volatile CHAN chan_comm;
+volatile CHAN chan_poll;
+
+// This test checks Recv_Timeout() and Send_Timeout(). A RR task waits on a channel with a
+// timeout of 5 ticks; a sender only sends every 8 ticks, so every other wait times out.
+// A periodic task polls a second channel with a timeout of 0, which it is allowed to
+// do, as it never blocks.
+// The expected behaviour is PA0 toggling on every timeout, PA1 toggling on every value
+// received, PA2 toggling every time the periodic task gets a value, and PA3 never going
+// high. The RTOS must not abort.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<TIMEOUT_PORT);
+	DDRA |= (1<<RECEIVED_PORT);
+	DDRA |= (1<<POLL_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+// Waits for a value for 5 ticks at a time
+void Task_Receiver()
+{
+	int v;
+	for(;;) {
+		if (Recv_Timeout(chan_comm, &v, 5)) {
+			if (v != 1) PORTA |= (1<<ERROR_PORT);
+			PORTA ^= (1<<RECEIVED_PORT);
+		} else {
+			PORTA ^= (1<<TIMEOUT_PORT);
+		}
+	}
+}
+
+void Task_Sender()
+{
+	for(;;) {
+		Task_Sleep(8);
+		// The receiver is waiting, unless it has just timed out
+		Send_Timeout(chan_comm, 1, 2);
+		// Nobody is waiting on chan_poll, so only a try can succeed
+		Send_Timeout(chan_poll, 2, 0);
+	}
+}
+
+void Task_Periodic()
+{
+	int v;
+	for(;;) {
+		if (Recv_Timeout(chan_poll, &v, 0)) {
+			if (v != 2) PORTA |= (1<<ERROR_PORT);
+			PORTA ^= (1<<POLL_PORT);
+		}
+		Task_Next();
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_comm = Chan_Init();
+	chan_poll = Chan_Init_Buffered(1);
+	Task_Create_RR(Task_Receiver, 0);
+	Task_Create_RR(Task_Sender, 0);
+	Task_Create_Period(Task_Periodic, 0, 3, 1, 1);
+}
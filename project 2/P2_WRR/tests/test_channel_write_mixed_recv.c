@@ -0,0 +1,59 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define TASK1_PORT PA0
+#define TASK2_PORT PA1
+#define TASK3_PORT PA2
+#define TASK4_PORT PA3
+#define TASK5_PORT PA4
+#define ERROR_PORT PA5
+
+volatile CHAN chan_comm;
+
+// This test ensures that one Write() reaches all receivers when some of them preempt the
+// writer and some do not. T1 and T3 are RR receivers, T2 and T4 are System receivers, and
+// T5 is the RR writer. All four receivers are woken at once; the System ones run first,
+// then the RR ones, which were queued before the writer.
+// Execution order: T2, T4, T1 and T3 block in Recv(), T5 writes, then T2, T4, T1, T3 and
+// T5 finish in that order.
+// PA5 never goes high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<TASK1_PORT);
+	DDRA |= (1<<TASK2_PORT);
+	DDRA |= (1<<TASK3_PORT);
+	DDRA |= (1<<TASK4_PORT);
+	DDRA |= (1<<TASK5_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+// Receiving task, its argument is its pin
+void Task_Receiver()
+{
+	int pin = Task_GetArg();
+
+	PORTA |= (1<<pin);
+	if (Recv( chan_comm ) != 1) PORTA |= (1<<ERROR_PORT);
+	PORTA &= ~(1<<pin);
+}
+
+// Sending task
+void Task_5()
+{
+	PORTA |= (1<<TASK5_PORT);
+	Write( chan_comm, 1 );
+	PORTA &= ~(1<<TASK5_PORT);
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_comm = Chan_Init();
+	Task_Create_System(Task_Receiver, TASK2_PORT);
+	Task_Create_System(Task_Receiver, TASK4_PORT);
+	Task_Create_RR(Task_Receiver, TASK1_PORT);
+	Task_Create_RR(Task_Receiver, TASK3_PORT);
+	Task_Create_RR(Task_5, 0);
+}
@@ -0,0 +1,61 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+This test has a periodic task allocate blocks of 8 to 40 bytes from the heap every
+period and pass them over a buffered CHAN to a RR task, which frees them. A periodic
+task may call Mem_Alloc() because it never blocks and takes a bounded time.
+The expected behaviour is PA1 toggling every period, PORTB showing how many bytes the
+periodic task has allocated right now, and PA2 never going high. After each free, the
+heap is back to a single free block unless a block is still in flight.
+*/
+
+#define IN_FLIGHT 4
+
+volatile CHAN chan_comm;
+volatile PID producer;
+void * volatile blocks[IN_FLIGHT];
+
+void Task_Producer()
+{
+  unsigned int size = 8;
+  unsigned int i = 0;
+  for(;;) {
+    unsigned char *b = Mem_Alloc(size);
+    if (b == NULL) {
+      PORTA |= (1<<PA2);
+    } else {
+      b[size-1] = size;
+      blocks[i] = b;
+      Write(chan_comm, i);
+      i = (i + 1) % IN_FLIGHT;
+    }
+    size = (size == 40) ? 8 : size + 8;
+    Task_Next();
+  }
+}
+
+void Task_Consumer()
+{
+  MEM_STATS stats;
+  for(;;) {
+    unsigned int i = Recv(chan_comm);
+    PORTA ^= (1<<PA1);
+    Mem_Free(blocks[i]);
+    PORTB = Task_HeapUsed(producer);
+    Mem_GetStats(&stats);
+    if (stats.used != Task_HeapUsed(producer)) PORTA |= (1<<PA2);
+  }
+}
+
+void a_main()
+{
+    DDRA |= (1<<PA1);
+    DDRA |= (1<<PA2);
+    DDRB = 0xFF;
+    chan_comm = Chan_Init_Buffered(IN_FLIGHT - 1);
+    Task_Create_RR(Task_Consumer, 0);
+    producer = Task_Create_Period(Task_Producer, 0, 5, 1, 0);
+}
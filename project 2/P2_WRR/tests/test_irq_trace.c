@@ -0,0 +1,96 @@
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "../os.h"
+
+#define ISR_PORT    PA0
+#define PING_PORT   PA1
+#define REPORT_PORT PA2
+#define ERROR_PORT  PA3
+
+volatile CHAN chan_irq;
+volatile CHAN chan_ping;
+volatile CHAN chan_pong;
+
+// Build with IRQ_TRACE set to 1. Two RR tasks keep the kernel busy with Send() and Recv(),
+// while TIMER1 interrupts every 100us and posts to a buffered channel with
+// Write_FromISR(). Many of these interrupts come while the kernel is running, and must not
+// wait for it to finish the system call. PA0 toggles in the ISR, so the jitter of its
+// edges against the 10kHz of TIMER1 is the interrupt latency. Every 100ms a System task
+// puts the longest interrupts-off window so far, in microseconds (255 if longer), on PORTB
+// and pulses PA2; Irq_GetStats() also tells the lines of os.c where the window began and
+// ended, for a debugger.
+// The expected behaviour is PA0 toggling every 100us with little jitter, PA1 toggling all
+// the time, a pulse on PA2 every 100ms with a small value on PORTB, and PA3 never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<ISR_PORT);
+	DDRA |= (1<<PING_PORT);
+	DDRA |= (1<<REPORT_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	DDRB = 0xFF;
+	PORTA = 0;
+	PORTB = 0;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	PORTA ^= (1<<ISR_PORT);
+	Write_FromISR(chan_irq, 1);
+	ISR_Exit();
+}
+
+void Task_Drain()
+{
+	for(;;) {
+		if (Recv(chan_irq) != 1) PORTA |= (1<<ERROR_PORT);
+	}
+}
+
+void Task_Ping()
+{
+	for(;;) {
+		Send(chan_ping, 1);
+		if (Recv(chan_pong) != 2) PORTA |= (1<<ERROR_PORT);
+		PORTA ^= (1<<PING_PORT);
+	}
+}
+
+void Task_Pong()
+{
+	for(;;) {
+		Send(chan_pong, Recv(chan_ping) + 1);
+	}
+}
+
+void Task_Report()
+{
+	IRQ_STATS stats;
+
+	for(;;) {
+		Task_Sleep(10);
+		Irq_GetStats(&stats);
+		if (stats.line == 0) PORTA |= (1<<ERROR_PORT);   // not built with IRQ_TRACE
+		PORTB = (stats.max_us > 255) ? 255 : stats.max_us;
+		PORTA |= (1<<REPORT_PORT);
+		PORTA &= ~(1<<REPORT_PORT);
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_irq = Chan_Init_Buffered(8);
+	chan_ping = Chan_Init();
+	chan_pong = Chan_Init();
+	Task_Create_System(Task_Drain, 0);
+	Task_Create_System(Task_Report, 0);
+	Task_Create_RR(Task_Ping, 0);
+	Task_Create_RR(Task_Pong, 0);
+
+	// TIMER1 in CTC mode, 16MHz / 8 / 200 = 10kHz
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS11);
+	OCR1A = 199;
+	TIMSK1 |= (1<<OCIE1A);
+}
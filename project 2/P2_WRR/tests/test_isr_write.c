@@ -0,0 +1,64 @@
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "../os.h"
+
+#define ISR_PORT    PA0
+#define SERVER_PORT PA1
+#define BUSY_PORT   PA2
+#define ERROR_PORT  PA3
+
+volatile CHAN chan_irq;
+
+// This test has TIMER1 interrupt every 1ms and post a value to a System task with
+// Write_FromISR(). PA0 goes high in the ISR and the System task pulls it low again, so
+// the width of the PA0 pulse is the ISR to task latency. A RR task keeps the CPU busy,
+// so the System task has to preempt it as soon as the ISR ends with ISR_Exit(), instead
+// of waiting for the next TICK.
+// The expected behaviour is a pulse on PA0 every 1ms that is only microseconds wide,
+// PA1 toggling with every pulse, PA2 toggling all the time, and PA3 never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<ISR_PORT);
+	DDRA |= (1<<SERVER_PORT);
+	DDRA |= (1<<BUSY_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	PORTA |= (1<<ISR_PORT);
+	if (!Write_FromISR(chan_irq, 1)) PORTA |= (1<<ERROR_PORT);
+	ISR_Exit();
+}
+
+void Task_Server()
+{
+	for(;;) {
+		if (Recv(chan_irq) != 1) PORTA |= (1<<ERROR_PORT);
+		PORTA &= ~(1<<ISR_PORT);
+		PORTA ^= (1<<SERVER_PORT);
+	}
+}
+
+void Task_Busy()
+{
+	for(;;) {
+		PORTA ^= (1<<BUSY_PORT);
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	chan_irq = Chan_Init();
+	Task_Create_System(Task_Server, 0);
+	Task_Create_RR(Task_Busy, 0);
+
+	// TIMER1 in CTC mode, 16MHz / 64 / 250 = 1kHz
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS11) | (1<<CS10);
+	OCR1A = 249;
+	TIMSK1 |= (1<<OCIE1A);
+}
@@ -0,0 +1,76 @@
+#include <avr/io.h>
+#include "../os.h"
+
+#define LOW_PORT    PA0
+#define OTHER_PORT  PA1
+#define HIGH_PORT   PA2
+#define ERROR_PORT  PA3
+
+MUTEX mutex;
+SEM sem;
+volatile int high_waits;
+
+// An RR task holds the mutex and waits on a semaphore, behind another RR task that
+// waited first. A System task then wants the mutex, so the owner inherits its priority
+// and moves ahead of the other waiter. One signal must wake the owner, which unlocks
+// and lets the System task in; only the second signal wakes the other RR task.
+// PA0 goes high when the owner wakes, PA2 when the System task gets the mutex and PA1
+// when the other RR task wakes.
+// The expected behaviour is rising edges on PA0, PA2 and PA1 in that order, and PA3
+// never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<LOW_PORT);
+	DDRA |= (1<<OTHER_PORT);
+	DDRA |= (1<<HIGH_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+void Task_Other()
+{
+	Sem_Wait(sem);
+	if (!(PORTA & (1<<HIGH_PORT))) PORTA |= (1<<ERROR_PORT);
+	PORTA |= (1<<OTHER_PORT);
+}
+
+void Task_Low()
+{
+	Mutex_Lock(mutex);
+	// let Task_Other wait on the semaphore first
+	Task_Next();
+	Sem_Wait(sem);
+	if (PORTA & (1<<OTHER_PORT)) PORTA |= (1<<ERROR_PORT);
+	PORTA |= (1<<LOW_PORT);
+	Mutex_Unlock(mutex);
+}
+
+void Task_High()
+{
+	Task_Sleep(3);
+	high_waits = 1;
+	Mutex_Lock(mutex);
+	if (!(PORTA & (1<<LOW_PORT))) PORTA |= (1<<ERROR_PORT);
+	PORTA |= (1<<HIGH_PORT);
+	Mutex_Unlock(mutex);
+}
+
+void Task_Signal()
+{
+	while (!high_waits) Task_Next();
+	Sem_Signal(sem);
+	Task_Next();
+	Sem_Signal(sem);
+}
+
+void a_main()
+{
+	init_debug_pins();
+	mutex = Mutex_Init();
+	sem = Sem_Init(0);
+	Task_Create_RR(Task_Other, 0);
+	Task_Create_RR(Task_Low, 0);
+	Task_Create_RR(Task_Signal, 0);
+	Task_Create_System(Task_High, 0);
+}
@@ -0,0 +1,74 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+#define LOW_PORT      PA0
+#define PERIODIC_PORT PA1
+#define HIGH_PORT     PA2
+#define ERROR_PORT    PA3
+
+MUTEX mutex;
+
+// An RR task holds the mutex for 20ms at a time. A System task wakes up every 70ms and
+// wants it, while a periodic task runs for 10ms every 100ms. Without inheritance the
+// periodic task would run ahead of the RR task while the System task waits, which is a
+// priority inversion. With it, the RR task runs as a System task until it unlocks.
+// PA0 is high while the RR task holds the mutex, PA1 while the periodic task runs, and PA2
+// while the System task waits for the mutex.
+// The expected behaviour is PA2 pulses of at most 20ms, each ending with a falling edge on
+// PA0, PA1 never rising while PA2 is high, and PA3 never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<LOW_PORT);
+	DDRA |= (1<<PERIODIC_PORT);
+	DDRA |= (1<<HIGH_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+void Task_Low()
+{
+	for(;;) {
+		Mutex_Lock(mutex);
+		PORTA |= (1<<LOW_PORT);
+		_delay_ms(20);
+		PORTA &= ~(1<<LOW_PORT);
+		Mutex_Unlock(mutex);
+		Task_Next();
+	}
+}
+
+void Task_Periodic()
+{
+	for(;;) {
+		PORTA |= (1<<PERIODIC_PORT);
+		_delay_ms(10);
+		// still waiting means we ran ahead of the mutex owner
+		if (PORTA & (1<<HIGH_PORT)) PORTA |= (1<<ERROR_PORT);
+		PORTA &= ~(1<<PERIODIC_PORT);
+		Task_Next();
+	}
+}
+
+void Task_High()
+{
+	for(;;) {
+		Task_Sleep(7);
+		PORTA |= (1<<HIGH_PORT);
+		Mutex_Lock(mutex);
+		PORTA &= ~(1<<HIGH_PORT);
+		if (PORTA & (1<<LOW_PORT)) PORTA |= (1<<ERROR_PORT);
+		Mutex_Unlock(mutex);
+	}
+}
+
+void a_main()
+{
+	init_debug_pins();
+	mutex = Mutex_Init();
+	Task_Create_RR(Task_Low, 0);
+	Task_Create_Period(Task_Periodic, 0, 10, 4, 1);
+	Task_Create_System(Task_High, 0);
+}
@@ -0,0 +1,45 @@
+#include "avr/io.h"
+#include "../os.h"
+
+#define RR_PORT       PA0
+#define PERIODIC_PORT PA2
+
+MUTEX mutex;
+
+// This test ensures that periodic tasks are not allowed to wait for a locked mutex.
+// The RR task locks the mutex and keeps it, then the periodic task wants it.
+// Execution order: [RR, T#, OS_Abort
+// Error code: ERROR_PERIODIC_BLOCK_OP (3)
+// Comment out the RR task to test a periodic task calling Task_Next() while it holds
+// the mutex instead, which aborts with ERROR_MUTEX_OWNER (11).
+
+void init_debug_pins()
+{
+	DDRA |= (1<<RR_PORT);
+	DDRA |= (1<<PERIODIC_PORT);
+	PORTA = 0;
+}
+
+void Task_RR()
+{
+	Mutex_Lock(mutex);
+	PORTA |= (1<<RR_PORT);
+	for(;;);
+}
+
+void Task_Periodic()
+{
+	PORTA |= (1<<PERIODIC_PORT);
+	Mutex_Lock(mutex);
+	Task_Next();
+	PORTA &= ~(1<<PERIODIC_PORT);
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	mutex = Mutex_Init();
+
+	Task_Create_RR(Task_RR, 0);
+	Task_Create_Period(Task_Periodic, 0, 100, 80, 2);
+}
@@ -0,0 +1,55 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+This test passes blocks of a 4 block pool from a producer to a slower consumer over a
+buffered CHAN. The producer allocates with Pool_Alloc_Wait(), so it blocks whenever all
+4 blocks are in flight, and resumes as soon as the consumer frees one.
+The expected behaviour is PA1 toggling every 20ms once the pool is exhausted, PORTB
+showing a high-water mark of 4, and PA2 never going high.
+*/
+
+volatile POOL pool;
+volatile CHAN chan_comm;
+
+typedef struct {
+  unsigned int seq;
+  unsigned char data[14];
+} BLOCK;
+
+void Task_Producer()
+{
+  unsigned int seq = 0;
+  for(;;) {
+    BLOCK *b = Pool_Alloc_Wait(pool);
+    if (b == NULL) PORTA |= (1<<PA2);
+    b->seq = ++seq;
+    Send(chan_comm, (int)b);
+  }
+}
+
+void Task_Consumer()
+{
+  POOL_STATS stats;
+  for(;;) {
+    BLOCK *b = (BLOCK *)Recv(chan_comm);
+    PORTA ^= (1<<PA1);
+    Task_Sleep(2);
+    Pool_Free(pool, b);
+    Pool_GetStats(pool, &stats);
+    PORTB = stats.high_water;
+  }
+}
+
+void a_main()
+{
+    DDRA |= (1<<PA1);
+    DDRA |= (1<<PA2);
+    DDRB = 0xFF;
+    pool = Pool_Create(sizeof(BLOCK), 4);
+    chan_comm = Chan_Init_Buffered(4);
+    Task_Create_RR(Task_Producer, 0);
+    Task_Create_RR(Task_Consumer, 0);
+}
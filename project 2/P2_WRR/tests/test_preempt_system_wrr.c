@@ -0,0 +1,43 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+This test creates a WRR task of weight 5, which never gives up the CPU, and a System
+task which sleeps for 20ms at a time. The System task must preempt the WRR task as
+soon as it wakes up, not when the WRR task's 5 tick quantum is over.
+PA1 is high while the WRR task runs and PA2 pulses every time the System task wakes.
+The expected behaviour is PA2 pulsing every 20ms, and PA3 never going high (it goes
+high if a sleep took 30ms or more).
+*/
+
+void Task_Busy()
+{
+  for(;;) {
+    PORTA |= (1<<PA1);
+  }
+}
+
+void Task_Sleeper()
+{
+  unsigned int start;
+  for(;;) {
+    start = Now();
+    Task_Sleep(2);
+    PORTA &= ~(1<<PA1);
+    PORTA |= (1<<PA2);
+    if (Now() - start >= 3 * MSECPERTICK) PORTA |= (1<<PA3);
+    _delay_ms(1);
+    PORTA &= ~(1<<PA2);
+  }
+}
+
+void a_main()
+{
+    DDRA |= (1<<PA1);
+    DDRA |= (1<<PA2);
+    DDRA |= (1<<PA3);
+    Task_Create_WRR(Task_Busy, 0, 5);
+    Task_Create_System(Task_Sleeper, 0);
+}
@@ -0,0 +1,95 @@
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "../os.h"
+
+#define ISR_PORT    PA0
+#define SERVER_PORT PA1
+#define ALL_PORT    PA2
+#define ERROR_PORT  PA3
+
+#define FLAG_ISR    1
+#define FLAG_TICK   2
+
+volatile SEM sem_irq;
+volatile EVENT event;
+
+// TIMER1 interrupts every 1ms and signals a System task with Sem_Signal_FromISR(). PA0
+// goes high in the ISR and the System task pulls it low again, so the width of the PA0
+// pulse is the ISR to task latency, as with Write_FromISR(). Every 10th signal, the
+// server sets FLAG_ISR, and a RR task sets FLAG_TICK every 20ms. A System task waits for
+// both flags with EVENT_ALL | EVENT_CLEAR, and another waits for FLAG_TICK with a timeout
+// that should never expire.
+// The expected behaviour is a pulse on PA0 every 1ms that is only microseconds wide, PA1
+// toggling with every pulse, PA2 toggling every 20ms, and PA3 never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<ISR_PORT);
+	DDRA |= (1<<SERVER_PORT);
+	DDRA |= (1<<ALL_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	PORTA = 0;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	PORTA |= (1<<ISR_PORT);
+	if (!Sem_Signal_FromISR(sem_irq)) PORTA |= (1<<ERROR_PORT);
+	ISR_Exit();
+}
+
+void Task_Server()
+{
+	unsigned int n = 0;
+
+	for(;;) {
+		Sem_Wait(sem_irq);
+		PORTA &= ~(1<<ISR_PORT);
+		PORTA ^= (1<<SERVER_PORT);
+		if (++n % 10 == 0) Event_Set(event, FLAG_ISR);
+	}
+}
+
+void Task_All()
+{
+	for(;;) {
+		if (Event_Wait(event, FLAG_ISR | FLAG_TICK, EVENT_ALL | EVENT_CLEAR) != (FLAG_ISR | FLAG_TICK)) {
+			PORTA |= (1<<ERROR_PORT);
+		}
+		PORTA ^= (1<<ALL_PORT);
+	}
+}
+
+void Task_Watchdog()
+{
+	for(;;) {
+		if (Event_Wait_Timeout(event, FLAG_TICK, EVENT_ANY, 5) == 0) PORTA |= (1<<ERROR_PORT);
+		// Task_All clears the flag
+		Task_Sleep(1);
+	}
+}
+
+void Task_Ticker()
+{
+	for(;;) {
+		Task_Sleep(2);
+		Event_Set(event, FLAG_TICK);
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	sem_irq = Sem_Init(0);
+	event = Event_Init();
+	Task_Create_System(Task_Server, 0);
+	Task_Create_System(Task_All, 0);
+	Task_Create_System(Task_Watchdog, 0);
+	Task_Create_RR(Task_Ticker, 0);
+
+	// TIMER1 in CTC mode, 16MHz / 64 / 250 = 1kHz
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS11) | (1<<CS10);
+	OCR1A = 249;
+	TIMSK1 |= (1<<OCIE1A);
+}
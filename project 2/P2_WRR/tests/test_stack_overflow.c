@@ -0,0 +1,56 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+Build with STACK_WATERMARK set to 1.
+This test checks the stack watermark and the overflow guard. Task_Shallow uses about
+64 bytes of its 256 byte stack, and the monitor shows its unused stack on PORTA.
+After 1 second, Task_Deep recurses until it runs out of its 128 byte stack.
+The expected behaviour is PORTA showing a value somewhat below 192 (the ISR also
+runs on Task_Shallow's stack), and then the RTOS aborting with 0x80 | PID of Task_Deep
+on PORTC, i.e. 0x85.
+*/
+
+PID shallow;
+
+void Task_Shallow()
+{
+  volatile unsigned char buf[64];
+  for(;;) {
+    buf[0] = 1;
+    buf[63] = buf[0];
+    Task_Next();
+  }
+}
+
+int Recurse(int n)
+{
+  volatile unsigned char buf[16];
+  buf[0] = n;
+  Task_Next(); // enter the kernel, which checks our stack
+  return Recurse(n + 1) + buf[0];
+}
+
+void Task_Deep()
+{
+  Recurse(0);
+}
+
+void Task_Monitor()
+{
+  for(;;) {
+    PORTA = Task_StackUnused(shallow);
+    Task_Sleep(10);
+  }
+}
+
+void a_main()
+{
+    DDRA = 0xFF;
+    shallow = Task_Create_RR_Stack(Task_Shallow, 0, 256);  // PID 3
+    Task_Create_System(Task_Monitor, 0);                    // PID 4
+    Task_Sleep(100);
+    Task_Create_RR_Stack(Task_Deep, 0, 128);                // PID 5
+}
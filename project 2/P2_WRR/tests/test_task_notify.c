@@ -0,0 +1,88 @@
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "../os.h"
+
+#define ISR_PORT    PA0
+#define SERVER_PORT PA1
+#define COUNT_PORT  PA2
+#define ERROR_PORT  PA3
+
+#define BIT_ISR     1
+#define BIT_TASK    2
+
+volatile PID server;
+
+// TIMER1 interrupts every 1ms and notifies a System task by its PID with
+// Task_Notify_FromISR(), setting BIT_ISR; no CHAN or other object is needed. PA0 goes high
+// in the ISR and the server pulls it low again, so the width of the PA0 pulse is the ISR
+// to task latency. A RR task sets BIT_TASK every 10ms with Task_Notify(), and the server
+// counts it on PORTB. A periodic task only ever tries, with a timeout of 0, and never
+// gets notified.
+// The expected behaviour is a pulse on PA0 every 1ms that is only microseconds wide, PA1
+// toggling with every pulse, PA2 toggling every 10ms with PORTB counting up, and PA3
+// never going high.
+
+void init_debug_pins()
+{
+	DDRA |= (1<<ISR_PORT);
+	DDRA |= (1<<SERVER_PORT);
+	DDRA |= (1<<COUNT_PORT);
+	DDRA |= (1<<ERROR_PORT);
+	DDRB = 0xFF;
+	PORTA = 0;
+	PORTB = 0;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	PORTA |= (1<<ISR_PORT);
+	if (!Task_Notify_FromISR(server, BIT_ISR, NOTIFY_SET_BITS)) PORTA |= (1<<ERROR_PORT);
+	ISR_Exit();
+}
+
+void Task_Server()
+{
+	unsigned int bits;
+
+	for(;;) {
+		if (!Task_Notify_Wait(~0U, &bits, WAIT_FOREVER)) PORTA |= (1<<ERROR_PORT);
+		if (bits & BIT_ISR) {
+			PORTA &= ~(1<<ISR_PORT);
+			PORTA ^= (1<<SERVER_PORT);
+		}
+		if (bits & BIT_TASK) {
+			PORTB++;
+			PORTA ^= (1<<COUNT_PORT);
+		}
+	}
+}
+
+void Task_Notifier()
+{
+	for(;;) {
+		Task_Sleep(1);
+		if (!Task_Notify(server, BIT_TASK, NOTIFY_SET_BITS)) PORTA |= (1<<ERROR_PORT);
+	}
+}
+
+void Task_Periodic()
+{
+	for(;;) {
+		if (Task_Notify_Wait(~0U, NULL, 0)) PORTA |= (1<<ERROR_PORT);
+		Task_Next();
+	}
+}
+
+void a_main(void)
+{
+	init_debug_pins();
+	server = Task_Create_System(Task_Server, 0);
+	Task_Create_RR(Task_Notifier, 0);
+	Task_Create_Period(Task_Periodic, 0, 5, 1, 0);
+
+	// TIMER1 in CTC mode, 16MHz / 64 / 250 = 1kHz
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS11) | (1<<CS10);
+	OCR1A = 249;
+	TIMSK1 |= (1<<OCIE1A);
+}
@@ -0,0 +1,60 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+This test creates a System task and a RR task which sleep instead of busy-waiting.
+The expected behaviour is PA1 pulsing every 100ms and PA2 every 50ms. Nothing else
+is ready in between, so the CPU should be asleep in the idle task most of the time.
+Another RR task works into the middle of a tick before each Task_SleepUntil(), which
+must still not return before Now() reaches its target; PA3 goes high if it does.
+*/
+
+void Task_S1()
+{
+  unsigned int wake = Now();
+  for(;;) {
+    PORTA |= (1<<PA1);
+    _delay_ms(5);
+    PORTA &= ~(1<<PA1);
+    wake += 100;
+    Task_SleepUntil(wake); // no drift, even with the 5ms of work
+  }
+}
+
+void Task_RR1()
+{
+  for(;;) {
+    PORTA |= (1<<PA2);
+    _delay_ms(5);
+    PORTA &= ~(1<<PA2);
+    Task_Sleep(5); // 50ms
+  }
+}
+
+void Task_RR2()
+{
+  unsigned int wake;
+  unsigned int k = 1;
+  for(;;) {
+    // start 3 to 7 ms into a tick
+    wake = Now();
+    while (Now() == wake || Now() % MSECPERTICK < 3 + k % 5) {
+    }
+    wake = Now() + k;
+    Task_SleepUntil(wake);
+    if ((int)(Now() - wake) < 0) PORTA |= (1<<PA3);
+    k = k % 25 + 1;
+  }
+}
+
+void a_main()
+{
+    DDRA |= (1<<PA1);
+    DDRA |= (1<<PA2);
+    DDRA |= (1<<PA3);
+    Task_Create_System(Task_S1, 0);
+    Task_Create_RR(Task_RR1, 0);
+    Task_Create_RR(Task_RR2, 0);
+}
@@ -0,0 +1,48 @@
+#include <avr/io.h>
+#define F_CPU 16000000
+#include <util/delay.h>
+#include "../os.h"
+
+/*
+This test creates tasks with their own stack sizes. Ten small RR tasks take 128 bytes
+each, and a spawner keeps creating a task with a 1024 byte stack, which terminates
+right away. The arena only has room for two of those at a time, so the spawner only
+keeps going if the stacks of terminated tasks are reclaimed.
+The expected behaviour is PA1 toggling forever, PA2 must never go high.
+*/
+
+void Task_Small()
+{
+  for(;;) {
+    Task_Next();
+  }
+}
+
+void Task_Big()
+{
+  volatile unsigned char buf[768]; // use most of the stack
+  buf[0] = 1;
+  buf[767] = buf[0];
+}
+
+void Task_Spawner()
+{
+  for(;;) {
+    if (Task_Create_RR_Stack(Task_Big, 0, 1024) == 0) {
+      PORTA |= (1<<PA2); // out of stack space
+    }
+    PORTA ^= (1<<PA1);
+    Task_Next();
+  }
+}
+
+void a_main()
+{
+    int i;
+    DDRA |= (1<<PA1);
+    DDRA |= (1<<PA2);
+    for (i = 0; i < 10; i++) {
+      Task_Create_RR_Stack(Task_Small, i, 128);
+    }
+    Task_Create_RR(Task_Spawner, 0);
+}
@@ -0,0 +1,237 @@
+/*
+ * tlsf.c
+ *
+ * Two-level segregated fit allocator, see tlsf.h.
+ *
+ * Every block starts with a header, and blocks follow each other in memory
+ * without gaps. A block knows the block before it ("prev_phys") and finds the
+ * one after it from its own size, so a freed block is merged with free
+ * neighbours on both sides right away. There are never two free blocks next
+ * to each other. The heap ends with an empty used block, the sentinel, so
+ * that merging stops there.
+ */
+#include <stddef.h>
+#include "tlsf.h"
+
+#define ALIGN_SIZE       (1U << TLSF_ALIGN_LOG2)
+#define ALIGN_UP(x)      (((x) + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1))
+
+// The payload starts after the links, which only a free block needs
+#define HEADER_SIZE      ALIGN_UP(offsetof(TLSF_BLOCK, next_free))
+#define MIN_PAYLOAD      ALIGN_UP(sizeof(TLSF_BLOCK) - HEADER_SIZE)
+#define SMALL_BLOCK      (1U << TLSF_FL_SHIFT)
+
+// Flags in the low bits of "size", which are always 0 in an aligned size
+#define BLOCK_FREE       1U
+#define PREV_FREE        2U
+#define SIZE_MASK        (~(BLOCK_FREE | PREV_FREE))
+
+#define block_size(b)    ((b)->size & SIZE_MASK)
+#define payload(b)       ((void *)((unsigned char *)(b) + HEADER_SIZE))
+#define block_of(p)      ((TLSF_BLOCK *)((unsigned char *)(p) - HEADER_SIZE))
+#define next_phys(b)     ((TLSF_BLOCK *)((unsigned char *)(b) + HEADER_SIZE + block_size(b)))
+
+// Index of the highest/lowest set bit, a bounded number of steps even without a CLZ instruction
+static int bit_fls(unsigned long x)
+{
+	return (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(x);
+}
+
+static int bit_ffs(unsigned long x)
+{
+	return __builtin_ctzl(x);
+}
+
+/**
+* The list a free block of "size" bytes goes into: small sizes have a list
+* each, larger ones are split into TLSF_SL_COUNT lists per power of two.
+*/
+static void mapping_insert(unsigned long size, int *fl, int *sl)
+{
+	if (size < SMALL_BLOCK) {
+		*fl = 0;
+		*sl = (int)(size >> TLSF_ALIGN_LOG2);
+	} else {
+		int t = bit_fls(size);
+		*sl = (int)(size >> (t - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+		*fl = t - TLSF_FL_SHIFT + 1;
+	}
+}
+
+/**
+* The first list whose blocks are all at least "size" bytes, so that the head
+* of any list from there on fits without searching the list.
+*/
+static void mapping_search(unsigned long size, int *fl, int *sl)
+{
+	if (size >= SMALL_BLOCK) {
+		size += (1UL << (bit_fls(size) - TLSF_SL_LOG2)) - 1;
+	}
+	mapping_insert(size, fl, sl);
+}
+
+static TLSF_BLOCK *search_suitable(TLSF *t, int *fl, int *sl)
+{
+	unsigned int sl_map = t->sl_bitmap[*fl] & (~0U << *sl);
+
+	if (sl_map == 0) {
+		// nothing left at this power of two, take the next one up
+		unsigned long fl_map = t->fl_bitmap & (~0UL << (*fl + 1));
+		if (fl_map == 0) return NULL;
+		*fl = bit_ffs(fl_map);
+		sl_map = t->sl_bitmap[*fl];
+	}
+	*sl = bit_ffs(sl_map);
+	return t->blocks[*fl][*sl];
+}
+
+static void insert_free(TLSF *t, TLSF_BLOCK *b)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(b), &fl, &sl);
+	b->prev_free = NULL;
+	b->next_free = t->blocks[fl][sl];
+	if (b->next_free != NULL) b->next_free->prev_free = b;
+	t->blocks[fl][sl] = b;
+	t->fl_bitmap |= 1UL << fl;
+	t->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void remove_free(TLSF *t, TLSF_BLOCK *b)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(b), &fl, &sl);
+	if (b->next_free != NULL) b->next_free->prev_free = b->prev_free;
+	if (b->prev_free != NULL) {
+		b->prev_free->next_free = b->next_free;
+	} else {
+		t->blocks[fl][sl] = b->next_free;
+		if (b->next_free == NULL) {
+			t->sl_bitmap[fl] &= ~(1U << sl);
+			if (t->sl_bitmap[fl] == 0) t->fl_bitmap &= ~(1UL << fl);
+		}
+	}
+}
+
+void tlsf_init(TLSF *t, void *mem, unsigned int size)
+{
+	TLSF_BLOCK *b = (TLSF_BLOCK *)mem;
+	TLSF_BLOCK *sentinel;
+	int fl, sl;
+
+	t->fl_bitmap = 0;
+	for (fl = 0; fl < (int)TLSF_FL_COUNT; fl++) {
+		t->sl_bitmap[fl] = 0;
+		for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+			t->blocks[fl][sl] = NULL;
+		}
+	}
+	t->first = b;
+	t->used = 0;
+
+	// one free block, followed by the sentinel
+	b->prev_phys = NULL;
+	b->size = ((size - 2 * HEADER_SIZE) & ~(ALIGN_SIZE - 1)) | BLOCK_FREE;
+	b->tag = 0;
+	sentinel = next_phys(b);
+	sentinel->prev_phys = b;
+	sentinel->size = PREV_FREE;
+	sentinel->tag = 0;
+	insert_free(t, b);
+}
+
+void *tlsf_malloc(TLSF *t, unsigned int size, unsigned int tag)
+{
+	TLSF_BLOCK *b;
+	unsigned long want = ALIGN_UP((unsigned long)size);
+	unsigned long remain;
+	int fl, sl;
+
+	if (size == 0) return NULL;
+	if (want < MIN_PAYLOAD) want = MIN_PAYLOAD;
+
+	mapping_search(want, &fl, &sl);
+	if (fl >= (int)TLSF_FL_COUNT) return NULL;
+	b = search_suitable(t, &fl, &sl);
+	if (b == NULL) return NULL;
+	remove_free(t, b);
+
+	remain = block_size(b) - want;
+	if (remain >= HEADER_SIZE + MIN_PAYLOAD) {
+		// the rest of the block stays free, its next block still has a free block before it
+		TLSF_BLOCK *rest = (TLSF_BLOCK *)((unsigned char *)payload(b) + want);
+		rest->prev_phys = b;
+		rest->size = (unsigned int)(remain - HEADER_SIZE) | BLOCK_FREE;
+		rest->tag = 0;
+		next_phys(rest)->prev_phys = rest;
+		insert_free(t, rest);
+		b->size = (unsigned int)want | (b->size & PREV_FREE);
+	} else {
+		next_phys(b)->size &= ~PREV_FREE;
+		b->size &= ~BLOCK_FREE;
+	}
+	b->tag = tag;
+	t->used += block_size(b);
+	return payload(b);
+}
+
+void tlsf_free(TLSF *t, void *p)
+{
+	TLSF_BLOCK *b, *next;
+
+	if (p == NULL) return;
+	b = block_of(p);
+	t->used -= block_size(b);
+	b->size |= BLOCK_FREE;
+	b->tag = 0;
+
+	if (b->size & PREV_FREE) {
+		TLSF_BLOCK *prev = b->prev_phys;
+		remove_free(t, prev);
+		prev->size += HEADER_SIZE + block_size(b);
+		b = prev;
+	}
+	next = next_phys(b);
+	if (next->size & BLOCK_FREE) {
+		remove_free(t, next);
+		b->size += HEADER_SIZE + block_size(next);
+		next = next_phys(b);
+	}
+	next->prev_phys = b;
+	next->size |= PREV_FREE;
+	insert_free(t, b);
+}
+
+unsigned int tlsf_size(void *p)
+{
+	return block_size(block_of(p));
+}
+
+unsigned int tlsf_tag(void *p)
+{
+	return block_of(p)->tag;
+}
+
+void tlsf_stats(TLSF *t, TLSF_STATS *stats)
+{
+	TLSF_BLOCK *b;
+
+	stats->free = 0;
+	stats->used = 0;
+	stats->largest_free = 0;
+	stats->free_blocks = 0;
+	stats->used_blocks = 0;
+	// the sentinel is the only used block of size 0
+	for (b = t->first; block_size(b) != 0 || (b->size & BLOCK_FREE); b = next_phys(b)) {
+		if (b->size & BLOCK_FREE) {
+			stats->free += block_size(b);
+			stats->free_blocks++;
+			if (block_size(b) > stats->largest_free) stats->largest_free = block_size(b);
+		} else {
+			stats->used += block_size(b);
+			stats->used_blocks++;
+		}
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * tlsf.h
+ *
+ * A two-level segregated fit (TLSF) allocator for variable-size blocks. The
+ * free blocks are kept in lists by size class: the first level splits sizes
+ * by powers of two, the second level splits each power of two linearly. A
+ * bitmap per level tells which lists are not empty, so tlsf_malloc() and
+ * tlsf_free() take a bounded number of steps no matter how many blocks there
+ * are. It does not disable interrupts itself, see Mem_Alloc() in os.c.
+ */
+#ifndef _TLSF_H_
+#define _TLSF_H_
+
+// Second level lists per power of two, and the alignment of block sizes
+#if __SIZEOF_POINTER__ <= 2
+#define TLSF_SL_LOG2      2
+#define TLSF_ALIGN_LOG2   2
+#else
+#define TLSF_SL_LOG2      4
+#define TLSF_ALIGN_LOG2   3
+#endif
+
+#define TLSF_SL_COUNT     (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT     (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_FL_COUNT     (sizeof(unsigned int) * 8 - TLSF_FL_SHIFT + 1)
+
+/**
+* Header of a block. A used block only needs "prev_phys", "size" and "tag",
+* the free list links are only valid while the block is free.
+*/
+typedef struct TlsfBlock
+{
+	struct TlsfBlock *prev_phys;    /* block just before this one in memory */
+	unsigned int size;              /* of the payload, the low bits are flags */
+	unsigned int tag;               /* given by the caller of tlsf_malloc() */
+
+	struct TlsfBlock *next_free;
+	struct TlsfBlock *prev_free;
+} TLSF_BLOCK;
+
+typedef struct Tlsf
+{
+	unsigned long fl_bitmap;
+	unsigned int sl_bitmap[TLSF_FL_COUNT];
+	TLSF_BLOCK *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+	TLSF_BLOCK *first;              /* first block of the heap */
+	unsigned int used;              /* in bytes, payload of the used blocks */
+} TLSF;
+
+typedef struct
+{
+	unsigned int free;              // in bytes, payload of the free blocks
+	unsigned int used;              // in bytes, payload of the used blocks
+	unsigned int largest_free;      // the largest block that can be allocated
+	unsigned int free_blocks;
+	unsigned int used_blocks;
+} TLSF_STATS;
+
+/**
+* Makes a heap of the "size" bytes at "mem", which must be aligned for any type.
+*/
+void tlsf_init(TLSF *t, void *mem, unsigned int size);
+
+/**
+* Returns a block of at least "size" bytes tagged with "tag", or NULL.
+*/
+void *tlsf_malloc(TLSF *t, unsigned int size, unsigned int tag);
+
+void tlsf_free(TLSF *t, void *p);
+
+/**
+* The usable size and the tag of an allocated block.
+*/
+unsigned int tlsf_size(void *p);
+unsigned int tlsf_tag(void *p);
+
+/**
+* Walks the whole heap, so unlike the other functions it takes time in
+* proportion to the number of blocks.
+*/
+void tlsf_stats(TLSF *t, TLSF_STATS *stats);
+
+#endif /* _TLSF_H_ */